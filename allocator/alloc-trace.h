@@ -0,0 +1,189 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+
+//
+// Binary allocation trace.
+//
+// File starts with TraceHeader followed by fixed size TraceRecords.
+// Blocks are identified by Id, which is unique among live blocks
+// and stays the same when block is reallocated.
+//
+
+enum class TraceOp : uint8_t
+{
+  Alloc = 0,
+  ReAlloc,
+  Free,
+  Reset,
+
+  //
+  // Size is byte budget for DefragmentStep,
+  // time budget in nanoseconds for DefragmentStepTime.
+  //
+  Defragment,
+  DefragmentStep,
+  DefragmentStepTime
+};
+
+struct TraceHeader
+{
+  char Magic[4]    = { 'A', 'T', 'R', 'C' };
+  uint32_t Version = 1;
+};
+
+struct TraceRecord
+{
+  //
+  // Nanoseconds since recording started.
+  //
+  uint64_t Timestamp = 0;
+
+  uint64_t Id   = 0;
+  uint64_t Size = 0;
+
+  uint32_t Alignment = 0;
+  TraceOp Op         = TraceOp::Alloc;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "Trace record layout changed");
+
+// =============================================================================
+
+//
+// Appends records to a file. Writes go through stdio buffer,
+// so recording costs a memcpy per operation most of the time.
+//
+class TraceRecorder
+{
+  public:
+    TraceRecorder(const std::string& fileName)
+    {
+      _file = fopen(fileName.data(), "wb");
+      if (_file == nullptr)
+      {
+        perror("TraceRecorder: fopen() failed");
+        return;
+      }
+
+      setvbuf(_file, nullptr, _IOFBF, BufferSize);
+
+      TraceHeader header;
+      fwrite(&header, sizeof(header), 1, _file);
+
+      _started = std::chrono::steady_clock::now();
+    }
+
+    ~TraceRecorder()
+    {
+      if (_file != nullptr)
+      {
+        fclose(_file);
+      }
+    }
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    bool IsOpen() const
+    {
+      return (_file != nullptr);
+    }
+
+    void Record(TraceOp op, uint64_t id, uint64_t size, uint64_t alignment = 0)
+    {
+      if (_file == nullptr)
+      {
+        return;
+      }
+
+      auto elapsed = std::chrono::steady_clock::now() - _started;
+
+      TraceRecord r;
+      r.Timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+      r.Id        = id;
+      r.Size      = size;
+      r.Alignment = alignment;
+      r.Op        = op;
+
+      fwrite(&r, sizeof(r), 1, _file);
+    }
+
+    void Flush()
+    {
+      if (_file != nullptr)
+      {
+        fflush(_file);
+      }
+    }
+
+  private:
+    static const size_t BufferSize = 64 * 1024;
+
+    FILE* _file = nullptr;
+
+    std::chrono::steady_clock::time_point _started;
+};
+
+// =============================================================================
+
+class TraceReader
+{
+  public:
+    TraceReader(const std::string& fileName)
+    {
+      _file = fopen(fileName.data(), "rb");
+      if (_file == nullptr)
+      {
+        perror("TraceReader: fopen() failed");
+        return;
+      }
+
+      TraceHeader expected;
+      TraceHeader header;
+
+      if (fread(&header, sizeof(header), 1, _file) != 1
+       or std::memcmp(header.Magic, expected.Magic, sizeof(header.Magic)) != 0
+       or header.Version != expected.Version)
+      {
+        printf("TraceReader: '%s' is not a trace file\n", fileName.data());
+
+        fclose(_file);
+        _file = nullptr;
+      }
+    }
+
+    ~TraceReader()
+    {
+      if (_file != nullptr)
+      {
+        fclose(_file);
+      }
+    }
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    bool IsOpen() const
+    {
+      return (_file != nullptr);
+    }
+
+    //
+    // Returns false at the end of the trace.
+    //
+    bool Next(TraceRecord& r)
+    {
+      return (_file != nullptr and fread(&r, sizeof(r), 1, _file) == 1);
+    }
+
+  private:
+    FILE* _file = nullptr;
+};
+
+#endif // include guard
@@ -0,0 +1,236 @@
+#ifndef ARENA_STORAGE_H
+#define ARENA_STORAGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+//
+// Backing memory for arenas.
+//
+// Data() must stay the same for the whole lifetime of the storage,
+// Commit(size) makes first 'size' bytes usable and returns false
+// if that's not possible.
+// Release(from) gives memory after 'from' back to the OS where possible
+// and returns offset starting from which memory now reads as zeros.
+//
+
+//
+// Memory is embedded into the owner object.
+//
+template <uint64_t MemorySize>
+class InlineStorage
+{
+  public:
+    //
+    // Contents are garbage until arena clears them.
+    //
+    static const bool StartsZeroed = false;
+
+    char* Data()
+    {
+      return _memory;
+    }
+
+    bool Commit(uint64_t size)
+    {
+      return (size <= MemorySize);
+    }
+
+    uint64_t Release(uint64_t)
+    {
+      return MemorySize;
+    }
+
+  private:
+    alignas(64) char _memory[MemorySize];
+};
+
+// =============================================================================
+
+//
+// Whole MemorySize is only reserved as virtual address range,
+// pages are committed in CommitGranularity steps as arena grows.
+// Since range never moves, growing requires no copying, and nothing
+// is resident until it's actually used.
+//
+// With HugePages range is aligned to 2 MB and marked for transparent
+// huge pages, so big arenas need fewer TLB entries. If kernel doesn't
+// support that, storage silently works with normal pages.
+//
+template <uint64_t MemorySize, bool HugePages>
+class BasicVirtualStorage
+{
+  public:
+    static const bool StartsZeroed = true;
+
+    static const uint64_t HugePageSize = 2 * 1024 * 1024;
+
+    //
+    // Committing whole huge pages lets kernel back them
+    // with huge pages right away.
+    //
+    static const uint64_t CommitGranularity = HugePages
+                                            ? HugePageSize
+                                            : 64 * 1024;
+
+    BasicVirtualStorage()
+    {
+      uint64_t alignment = HugePages ? HugePageSize : 0;
+
+      _mapped = RoundUp(MemorySize, HugePages ? HugePageSize : PageSize());
+
+      //
+      // mmap() only guarantees page alignment,
+      // so reserve extra and trim both ends.
+      //
+      uint64_t reserved = _mapped + alignment;
+
+      void* p = mmap(nullptr,
+                     reserved,
+                     PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1,
+                     0);
+
+      if (p == MAP_FAILED)
+      {
+        perror("BasicVirtualStorage: mmap() failed");
+        return;
+      }
+
+      char* start   = (char*)p;
+      char* aligned = start;
+
+      if (alignment != 0)
+      {
+        aligned = (char*)RoundUp((uintptr_t)start, alignment);
+
+        if (aligned != start)
+        {
+          munmap(start, aligned - start);
+        }
+
+        char* end = aligned + _mapped;
+        if (end != start + reserved)
+        {
+          munmap(end, start + reserved - end);
+        }
+      }
+
+      _memory = aligned;
+
+#ifdef MADV_HUGEPAGE
+      if (HugePages)
+      {
+        _hugePages = (madvise(_memory, _mapped, MADV_HUGEPAGE) == 0);
+      }
+#endif
+    }
+
+    ~BasicVirtualStorage()
+    {
+      if (_memory != nullptr)
+      {
+        munmap(_memory, _mapped);
+      }
+    }
+
+    BasicVirtualStorage(const BasicVirtualStorage&) = delete;
+    BasicVirtualStorage& operator=(const BasicVirtualStorage&) = delete;
+
+    char* Data()
+    {
+      return _memory;
+    }
+
+    bool Commit(uint64_t size)
+    {
+      if (_memory == nullptr or size > MemorySize)
+      {
+        return false;
+      }
+
+      if (size <= _committed)
+      {
+        return true;
+      }
+
+      uint64_t newCommitted = std::min(RoundUp(size, CommitGranularity),
+                                       _mapped);
+
+      int succ = mprotect(_memory + _committed,
+                          newCommitted - _committed,
+                          PROT_READ | PROT_WRITE);
+      if (succ != 0)
+      {
+        return false;
+      }
+
+      _committed = newCommitted;
+
+      return true;
+    }
+
+    //
+    // Pages stay committed, but are dropped from RSS
+    // and come back zero-filled on next touch.
+    // Huge pages are released only as a whole, so they don't get split.
+    //
+    uint64_t Release(uint64_t from)
+    {
+      from = RoundUp(from, _hugePages ? HugePageSize : PageSize());
+
+      if (from >= _committed)
+      {
+        return std::max(from, _committed);
+      }
+
+      int succ = madvise(_memory + from, _committed - from, MADV_DONTNEED);
+
+      return (succ == 0) ? from : _committed;
+    }
+
+    uint64_t Committed() const
+    {
+      return _committed;
+    }
+
+    //
+    // False if huge pages were requested but kernel refused them.
+    //
+    bool UsesHugePages() const
+    {
+      return _hugePages;
+    }
+
+  private:
+    static uint64_t PageSize()
+    {
+      static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+      return pageSize;
+    }
+
+    static uint64_t RoundUp(uint64_t value, uint64_t alignment)
+    {
+      return (value + alignment - 1) / alignment * alignment;
+    }
+
+    char* _memory = nullptr;
+
+    uint64_t _mapped    = 0;
+    uint64_t _committed = 0;
+
+    bool _hugePages = false;
+};
+
+template <uint64_t MemorySize>
+using VirtualStorage = BasicVirtualStorage<MemorySize, false>;
+
+template <uint64_t MemorySize>
+using HugePageStorage = BasicVirtualStorage<MemorySize, true>;
+
+#endif // include guard
@@ -0,0 +1,179 @@
+#ifndef ATOMIC_ARENA_H
+#define ATOMIC_ARENA_H
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+
+//
+// Lock-free bump allocator for short-lived scratch data.
+//
+// Alloc() is a single fetch_add on the index, there is no per-block
+// bookkeeping and no Free(): everything is released at once by Reset().
+//
+// Workers that are allocating wrap their work in Enter() / Leave()
+// (or EpochGuard). Reset() closes current epoch, waits until every worker
+// has left it, rewinds the index and opens the next one, so no one
+// can hold a block that is being handed out again.
+//
+template <uint64_t MemorySize, uint32_t MaxWorkers = 64>
+class AtomicArena
+{
+  public:
+    static const uint64_t DefaultAlignment = 16;
+
+    AtomicArena()
+    {
+      for (auto& e : _workerEpoch)
+      {
+        e.Value.store(Idle, std::memory_order_relaxed);
+      }
+    }
+
+    //
+    // Returns nullptr when arena is exhausted.
+    // Alignment must be power of two.
+    //
+    void* Alloc(uint64_t size, uint64_t alignment = DefaultAlignment)
+    {
+      if (size > MemorySize or alignment > MemorySize)
+      {
+        return nullptr;
+      }
+
+      //
+      // Reserving size + alignment - 1 and aligning inside
+      // keeps this a single atomic operation.
+      //
+      uint64_t reserve = size + alignment - 1;
+      uint64_t offset  = _index.fetch_add(reserve, std::memory_order_relaxed);
+
+      //
+      // Failed requests still move the index past the end,
+      // but by no more than 2 * MemorySize each.
+      //
+      if (offset > MemorySize or reserve > MemorySize - offset)
+      {
+        return nullptr;
+      }
+
+      uintptr_t addr = (uintptr_t)&_memory[offset];
+      addr = (addr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+      return (void*)addr;
+    }
+
+    //
+    // Marks worker as active in current epoch.
+    // Blocks while Reset() is in progress.
+    //
+    void Enter(uint32_t worker)
+    {
+      auto& e = _workerEpoch[worker].Value;
+
+      while (true)
+      {
+        uint64_t epoch = _epoch.load(std::memory_order_acquire);
+        if (epoch % 2 != 0)
+        {
+          std::this_thread::yield();
+          continue;
+        }
+
+        e.store(epoch, std::memory_order_seq_cst);
+
+        //
+        // Reset() might have started in between,
+        // in that case step out and wait for it.
+        //
+        if (_epoch.load(std::memory_order_seq_cst) == epoch)
+        {
+          break;
+        }
+
+        e.store(Idle, std::memory_order_release);
+      }
+    }
+
+    void Leave(uint32_t worker)
+    {
+      _workerEpoch[worker].Value.store(Idle, std::memory_order_release);
+    }
+
+    //
+    // Releases all blocks. Waits for workers still inside previous epoch.
+    // Epoch is odd while reset is in progress, so nobody can enter.
+    // Should be called by one thread at a time.
+    //
+    void Reset()
+    {
+      uint64_t old = _epoch.fetch_add(1, std::memory_order_seq_cst);
+
+      for (auto& e : _workerEpoch)
+      {
+        while (e.Value.load(std::memory_order_acquire) <= old)
+        {
+          std::this_thread::yield();
+        }
+      }
+
+      _index.store(0, std::memory_order_relaxed);
+
+      _epoch.fetch_add(1, std::memory_order_release);
+    }
+
+    uint64_t Epoch() const
+    {
+      return _epoch.load(std::memory_order_acquire);
+    }
+
+    uint64_t BytesUsed() const
+    {
+      uint64_t index = _index.load(std::memory_order_relaxed);
+      return (index > MemorySize) ? MemorySize : index;
+    }
+
+    class EpochGuard
+    {
+      public:
+        EpochGuard(AtomicArena& arena, uint32_t worker)
+          : _arena(arena),
+            _worker(worker)
+        {
+          _arena.Enter(_worker);
+        }
+
+        ~EpochGuard()
+        {
+          _arena.Leave(_worker);
+        }
+
+        EpochGuard(const EpochGuard&) = delete;
+        EpochGuard& operator=(const EpochGuard&) = delete;
+
+      private:
+        AtomicArena& _arena;
+        uint32_t _worker;
+    };
+
+  private:
+    static const uint64_t Idle = UINT64_MAX;
+
+    //
+    // Each worker slot is on its own cache line
+    // to avoid false sharing between workers.
+    //
+    struct alignas(64) WorkerEpoch
+    {
+      std::atomic<uint64_t> Value;
+    };
+
+    alignas(64) char _memory[MemorySize];
+
+    alignas(64) std::atomic<uint64_t> _index{0};
+    alignas(64) std::atomic<uint64_t> _epoch{0};
+
+    WorkerEpoch _workerEpoch[MaxWorkers];
+};
+
+#endif // include guard
@@ -0,0 +1,227 @@
+#ifndef BENCH_BACKENDS_H
+#define BENCH_BACKENDS_H
+
+#include "smart-allocator.h"
+#include "small-allocator.h"
+
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+
+#include <malloc.h>
+
+//
+// Allocators wrapped into the same interface for allocator_bench
+// and allocator_replay, so that workloads are written once.
+//
+// Ref is whatever backend refers to blocks with.
+// Blocks are Alignment aligned on every backend.
+//
+
+const uint64_t Alignment = 16;
+
+// =============================================================================
+
+struct MallocBackend
+{
+  using Ref = void*;
+
+  static constexpr const char* Name = "malloc";
+  static constexpr bool ThreadSafe  = true;
+
+  Ref Alloc(uint64_t size)
+  {
+    return malloc(size);
+  }
+
+  Ref ReAlloc(Ref ref, uint64_t size)
+  {
+    return realloc(ref, size);
+  }
+
+  void Free(Ref ref)
+  {
+    free(ref);
+  }
+
+  char* Addr(Ref ref)
+  {
+    return (char*)ref;
+  }
+
+  bool IsNull(Ref ref)
+  {
+    return (ref == nullptr);
+  }
+
+  //
+  // Includes bookkeeping of the benchmark itself.
+  //
+  uint64_t Footprint()
+  {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+  }
+
+  void Defragment()
+  {
+  }
+
+  void DefragmentStep(uint64_t)
+  {
+  }
+
+  void DefragmentStep(std::chrono::nanoseconds)
+  {
+  }
+};
+
+// =============================================================================
+
+//
+// Arena only grows at the end, so when it's full it is compacted
+// and allocation is retried. Compaction time counts towards the run.
+//
+template <uint64_t ArenaSize>
+struct BasicSmartBackend
+{
+  using Allocator = SmartAllocator<ArenaSize, 0, VirtualStorage>;
+  using Ref       = typename Allocator::Handle;
+
+  static constexpr const char* Name = "SmartAllocator";
+  static constexpr bool ThreadSafe  = false;
+
+  Ref Alloc(uint64_t size)
+  {
+    Ref ref = _allocator.Alloc(size, Alignment);
+    if (ref.IsNull())
+    {
+      _allocator.Defragment();
+      ref = _allocator.Alloc(size, Alignment);
+    }
+
+    return ref;
+  }
+
+  Ref ReAlloc(Ref ref, uint64_t size)
+  {
+    Ref newRef = _allocator.ReAlloc(ref, size);
+    if (newRef.IsNull())
+    {
+      _allocator.Defragment();
+      newRef = _allocator.ReAlloc(ref, size);
+    }
+
+    return newRef;
+  }
+
+  void Free(Ref ref)
+  {
+    _allocator.Free(ref);
+  }
+
+  char* Addr(Ref ref)
+  {
+    return (char*)_allocator.Get(ref).Addr;
+  }
+
+  bool IsNull(Ref ref)
+  {
+    return ref.IsNull();
+  }
+
+  uint64_t Footprint()
+  {
+    return _allocator.GetStats().ArenaUsed;
+  }
+
+  void Defragment()
+  {
+    _allocator.Defragment();
+  }
+
+  void DefragmentStep(uint64_t byteBudget)
+  {
+    _allocator.DefragmentStep(byteBudget);
+  }
+
+  void DefragmentStep(std::chrono::nanoseconds timeBudget)
+  {
+    _allocator.DefragmentStep(timeBudget);
+  }
+
+  Allocator _allocator;
+};
+
+//
+// Small enough to fill up and get compacted while patterns run.
+//
+using SmartBackend = BasicSmartBackend<16 * 1024 * 1024>;
+
+// =============================================================================
+
+//
+// Raw pointers are handed out, so arena can't be compacted
+// behind the pattern's back: when it's full allocation fails.
+//
+struct SmallBackend
+{
+  using Allocator = SmallAllocator<4 * 1024 * 1024>;
+  using Ref       = void*;
+
+  static constexpr const char* Name = "SmallAllocator";
+  static constexpr bool ThreadSafe  = false;
+
+  Ref Alloc(uint64_t size)
+  {
+    return _allocator->Alloc(size, Alignment);
+  }
+
+  Ref ReAlloc(Ref ref, uint64_t size)
+  {
+    return _allocator->ReAlloc(ref, size);
+  }
+
+  void Free(Ref ref)
+  {
+    _allocator->Free(ref);
+  }
+
+  char* Addr(Ref ref)
+  {
+    return (char*)ref;
+  }
+
+  bool IsNull(Ref ref)
+  {
+    return (ref == nullptr);
+  }
+
+  uint64_t Footprint()
+  {
+    return _allocator->BytesUsed();
+  }
+
+  //
+  // Would invalidate pointers.
+  //
+  void Defragment()
+  {
+  }
+
+  void DefragmentStep(uint64_t)
+  {
+  }
+
+  void DefragmentStep(std::chrono::nanoseconds)
+  {
+  }
+
+  //
+  // Side tables are too big for the stack.
+  //
+  std::unique_ptr<Allocator> _allocator = std::make_unique<Allocator>();
+};
+
+#endif // include guard
@@ -0,0 +1,554 @@
+#include "bench-backends.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//
+// Runs every allocator through the same allocation patterns
+// and reports time per operation, peak RSS and fragmentation.
+//
+// Every pattern / allocator pair runs in its own forked process,
+// so peak RSS of one run doesn't leak into the next one.
+//
+// Fragmentation is 1 - (live bytes / footprint), where footprint
+// is how much of the arena (or malloc heap) is in use,
+// measured when the pattern has the most data alive.
+//
+
+// =============================================================================
+
+struct Result
+{
+  uint64_t Ops    = 0;
+  uint64_t Failed = 0;
+
+  double Fragmentation = 0.0;
+
+  std::chrono::nanoseconds Elapsed{0};
+};
+
+//
+// Keeps track of live bytes and samples fragmentation
+// at the point where most data is alive.
+//
+template <typename B>
+class Tracker
+{
+  public:
+    Tracker(B& backend, Result& result)
+      : _backend(backend),
+        _result(result)
+    {
+    }
+
+    void Allocated(uint64_t size)
+    {
+      _liveBytes += size;
+      _result.Ops++;
+    }
+
+    void Freed(uint64_t size)
+    {
+      _liveBytes -= size;
+      _result.Ops++;
+    }
+
+    void Failed()
+    {
+      _result.Failed++;
+      _result.Ops++;
+    }
+
+    void Sample()
+    {
+      if (_liveBytes <= _peakLiveBytes)
+      {
+        return;
+      }
+
+      _peakLiveBytes = _liveBytes;
+
+      uint64_t footprint = _backend.Footprint();
+
+      _result.Fragmentation = (footprint == 0 or footprint < _liveBytes)
+                            ? 0.0
+                            : 1.0 - (double)_liveBytes / footprint;
+    }
+
+  private:
+    B& _backend;
+    Result& _result;
+
+    uint64_t _liveBytes     = 0;
+    uint64_t _peakLiveBytes = 0;
+};
+
+template <typename B>
+struct Block
+{
+  typename B::Ref Ref;
+  uint64_t Size = 0;
+};
+
+template <typename B>
+bool AllocBlock(B& b, Tracker<B>& t, Block<B>& block, uint64_t size)
+{
+  block.Ref  = b.Alloc(size);
+  block.Size = size;
+
+  if (b.IsNull(block.Ref))
+  {
+    t.Failed();
+    return false;
+  }
+
+  b.Addr(block.Ref)[0] = 1;
+
+  t.Allocated(size);
+
+  return true;
+}
+
+template <typename B>
+void FreeBlock(B& b, Tracker<B>& t, Block<B>& block)
+{
+  if (b.IsNull(block.Ref))
+  {
+    return;
+  }
+
+  b.Free(block.Ref);
+
+  t.Freed(block.Size);
+
+  block.Ref = typename B::Ref();
+}
+
+// =============================================================================
+
+const uint64_t BatchSize = 1000;
+
+uint64_t SmallSize(std::mt19937& rng)
+{
+  return 16 + rng() % 241;
+}
+
+//
+// Log-uniform from 8 bytes to 8 KB.
+//
+uint64_t MixedSize(std::mt19937& rng)
+{
+  uint64_t log2 = 3 + rng() % 11;
+  return (uint64_t(1) << log2) + rng() % (uint64_t(1) << log2);
+}
+
+//
+// Allocates a batch and frees it in reverse or in the same order.
+//
+template <typename B>
+void Batches(B& b, Result& r, uint64_t rounds, bool lifo)
+{
+  Tracker<B> t(b, r);
+  std::mt19937 rng(1);
+
+  std::vector<Block<B>> blocks(BatchSize);
+
+  for (uint64_t round = 0; round < rounds; round++)
+  {
+    for (auto& block : blocks)
+    {
+      AllocBlock(b, t, block, SmallSize(rng));
+    }
+
+    t.Sample();
+
+    for (uint64_t i = 0; i < BatchSize; i++)
+    {
+      FreeBlock(b, t, blocks[lifo ? BatchSize - 1 - i : i]);
+    }
+  }
+}
+
+template <typename B>
+void Lifo(B& b, Result& r, uint64_t rounds)
+{
+  Batches(b, r, rounds, true);
+}
+
+template <typename B>
+void Fifo(B& b, Result& r, uint64_t rounds)
+{
+  Batches(b, r, rounds, false);
+}
+
+//
+// Keeps BatchSize blocks alive, replacing random one every step.
+//
+template <typename B>
+void RandomFree(B& b, Result& r, uint64_t rounds, uint64_t (*sizeOf)(std::mt19937&))
+{
+  Tracker<B> t(b, r);
+  std::mt19937 rng(1);
+
+  std::vector<Block<B>> blocks(BatchSize);
+
+  for (auto& block : blocks)
+  {
+    AllocBlock(b, t, block, sizeOf(rng));
+  }
+
+  for (uint64_t step = 0; step < rounds * BatchSize; step++)
+  {
+    Block<B>& block = blocks[rng() % BatchSize];
+
+    FreeBlock(b, t, block);
+    AllocBlock(b, t, block, sizeOf(rng));
+
+    if (step % BatchSize == 0)
+    {
+      t.Sample();
+    }
+  }
+
+  for (auto& block : blocks)
+  {
+    FreeBlock(b, t, block);
+  }
+}
+
+template <typename B>
+void Random(B& b, Result& r, uint64_t rounds)
+{
+  RandomFree(b, r, rounds, SmallSize);
+}
+
+template <typename B>
+void Mixed(B& b, Result& r, uint64_t rounds)
+{
+  RandomFree(b, r, rounds, MixedSize);
+}
+
+//
+// Grows a few buffers in turns, like vectors being filled.
+//
+template <typename B>
+void ReAllocGrow(B& b, Result& r, uint64_t rounds)
+{
+  Tracker<B> t(b, r);
+
+  const uint64_t buffers = 64;
+  const uint64_t maxSize = 16 * 1024;
+
+  std::vector<Block<B>> blocks(buffers);
+
+  for (uint64_t round = 0; round < rounds; round++)
+  {
+    for (auto& block : blocks)
+    {
+      AllocBlock(b, t, block, 16);
+    }
+
+    for (uint64_t size = 32; size <= maxSize; size += size / 2)
+    {
+      for (auto& block : blocks)
+      {
+        if (b.IsNull(block.Ref))
+        {
+          continue;
+        }
+
+        typename B::Ref ref = b.ReAlloc(block.Ref, size);
+        if (b.IsNull(ref))
+        {
+          t.Failed();
+          continue;
+        }
+
+        b.Addr(ref)[size - 1] = 1;
+
+        t.Freed(block.Size);
+        t.Allocated(size);
+
+        block.Ref  = ref;
+        block.Size = size;
+      }
+    }
+
+    t.Sample();
+
+    for (auto& block : blocks)
+    {
+      FreeBlock(b, t, block);
+    }
+  }
+}
+
+//
+// One thread allocates, another one frees.
+// Backends that are not thread safe are put behind a mutex.
+//
+template <typename B>
+void ProducerConsumer(B& b, Result& r, uint64_t rounds)
+{
+  Tracker<B> t(b, r);
+  std::mt19937 rng(1);
+
+  std::mutex allocatorMutex;
+  std::mutex queueMutex;
+  std::condition_variable queueChanged;
+
+  std::deque<Block<B>> queue;
+
+  bool done = false;
+
+  const uint64_t maxQueue = BatchSize;
+
+  auto locked = [&allocatorMutex](auto f)
+  {
+    if (B::ThreadSafe)
+    {
+      f();
+    }
+    else
+    {
+      std::lock_guard<std::mutex> lock(allocatorMutex);
+      f();
+    }
+  };
+
+  std::thread consumer([&]()
+  {
+    while (true)
+    {
+      Block<B> block;
+
+      {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        queueChanged.wait(lock, [&]() { return (done or not queue.empty()); });
+
+        if (queue.empty())
+        {
+          break;
+        }
+
+        block = queue.front();
+        queue.pop_front();
+      }
+
+      queueChanged.notify_all();
+
+      locked([&]() { b.Free(block.Ref); });
+    }
+  });
+
+  for (uint64_t i = 0; i < rounds * BatchSize; i++)
+  {
+    Block<B> block;
+    block.Size = SmallSize(rng);
+
+    locked([&]() { block.Ref = b.Alloc(block.Size); });
+
+    if (b.IsNull(block.Ref))
+    {
+      t.Failed();
+      continue;
+    }
+
+    //
+    // Both sides of the exchange are counted here,
+    // consumer doesn't touch the tracker.
+    //
+    r.Ops += 2;
+
+    std::unique_lock<std::mutex> lock(queueMutex);
+    queueChanged.wait(lock, [&]() { return (queue.size() < maxQueue); });
+
+    queue.push_back(block);
+    queueChanged.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    done = true;
+  }
+
+  queueChanged.notify_all();
+
+  consumer.join();
+}
+
+// =============================================================================
+
+template <typename B>
+using Pattern = void (*)(B&, Result&, uint64_t);
+
+struct PatternInfo
+{
+  const char* Name;
+
+  Pattern<MallocBackend> Malloc;
+  Pattern<SmartBackend> Smart;
+  Pattern<SmallBackend> Small;
+};
+
+#define PATTERN(name, f) { name, f<MallocBackend>, f<SmartBackend>, f<SmallBackend> }
+
+const PatternInfo Patterns[] =
+{
+  PATTERN("lifo",              Lifo),
+  PATTERN("fifo",              Fifo),
+  PATTERN("random-free",       Random),
+  PATTERN("realloc-grow",      ReAllocGrow),
+  PATTERN("mixed-sizes",       Mixed),
+  PATTERN("producer-consumer", ProducerConsumer)
+};
+
+#undef PATTERN
+
+struct Report
+{
+  Result Run;
+  long PeakRssKb = 0;
+};
+
+template <typename B>
+Report RunPattern(Pattern<B> pattern, uint64_t rounds)
+{
+  Report report;
+
+  auto backend = std::make_unique<B>();
+
+  auto started = std::chrono::steady_clock::now();
+
+  pattern(*backend, report.Run, rounds);
+
+  report.Run.Elapsed = std::chrono::steady_clock::now() - started;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  report.PeakRssKb = usage.ru_maxrss;
+
+  return report;
+}
+
+//
+// Runs the pattern in a child process and collects its report.
+//
+template <typename B>
+bool RunIsolated(Pattern<B> pattern, uint64_t rounds, Report& report)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+  {
+    perror("pipe()");
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork()");
+    return false;
+  }
+
+  if (pid == 0)
+  {
+    close(fds[0]);
+
+    //
+    // Keep allocators' own chatter out of the report.
+    //
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+
+    Report r = RunPattern(pattern, rounds);
+
+    ssize_t written = write(fds[1], &r, sizeof(r));
+
+    _exit(written == sizeof(r) ? 0 : 1);
+  }
+
+  close(fds[1]);
+
+  ssize_t got = read(fds[0], &report, sizeof(report));
+
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+
+  return (got == sizeof(report) and WIFEXITED(status) and WEXITSTATUS(status) == 0);
+}
+
+template <typename B>
+void PrintRun(const char* pattern, Pattern<B> f, uint64_t rounds)
+{
+  Report report;
+
+  if (not RunIsolated(f, rounds, report))
+  {
+    printf("%-18s %-15s %s\n", pattern, B::Name, "crashed");
+    return;
+  }
+
+  double nsPerOp = (report.Run.Ops == 0)
+                 ? 0.0
+                 : (double)report.Run.Elapsed.count() / report.Run.Ops;
+
+  printf("%-18s %-15s %10.1f %10llu %12ld %8.3f\n",
+         pattern,
+         B::Name,
+         nsPerOp,
+         (unsigned long long)report.Run.Failed,
+         report.PeakRssKb,
+         report.Run.Fragmentation);
+
+  fflush(stdout);
+}
+
+// =============================================================================
+
+int main(int argc, char* argv[])
+{
+  uint64_t rounds = 200;
+
+  if (argc > 1)
+  {
+    rounds = strtoull(argv[1], nullptr, 10);
+  }
+
+  if (rounds == 0)
+  {
+    printf("Usage: %s [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-18s %-15s %10s %10s %12s %8s\n",
+         "pattern", "allocator", "ns/op", "failed", "peak RSS KB", "frag");
+
+  for (const auto& p : Patterns)
+  {
+    PrintRun(p.Name, p.Malloc, rounds);
+    PrintRun(p.Name, p.Smart, rounds);
+    PrintRun(p.Name, p.Small, rounds);
+  }
+
+  return 0;
+}
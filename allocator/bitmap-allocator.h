@@ -0,0 +1,375 @@
+#ifndef BITMAP_ALLOCATOR_H
+#define BITMAP_ALLOCATOR_H
+
+#include "arena-storage.h"
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//
+// Allocator for arenas full of tiny objects.
+//
+// Arena is split into 16 byte granules and the only bookkeeping
+// is one bit per granule, set while granule is in use, which is
+// 1/128 of the arena. Blocks don't remember their size,
+// so Free() takes it, same as sized operator delete.
+//
+// Alloc() looks for a run of free bits first fit, 64 granules at a time,
+// and Free() just clears the bits. Full words are skipped
+// four at a time when built with AVX2.
+//
+template <uint64_t MemorySize,
+          template <uint64_t> class Storage = InlineStorage>
+class BitmapAllocator
+{
+  public:
+    static const uint64_t GranuleSize = 16;
+
+    struct Stats
+    {
+      uint64_t Capacity          = 0;
+      uint64_t BytesUsed         = 0;
+      uint64_t FreeBytes         = 0;
+      uint64_t FreeExtents       = 0;
+      uint64_t LargestFreeExtent = 0;
+
+      //
+      // 0 when all free space is in one piece, close to 1
+      // when it's scattered into many small holes.
+      //
+      double Fragmentation() const
+      {
+        return (FreeBytes == 0)
+             ? 0.0
+             : 1.0 - (double)LargestFreeExtent / FreeBytes;
+      }
+    };
+
+    BitmapAllocator()
+    {
+      Reset();
+    }
+
+    BitmapAllocator(const BitmapAllocator&) = delete;
+    BitmapAllocator& operator=(const BitmapAllocator&) = delete;
+
+    //
+    // Alignment must be power of two,
+    // anything below GranuleSize is rounded up to it.
+    //
+    void* Alloc(uint64_t size, uint64_t alignment = GranuleSize)
+    {
+      if (alignment == 0 or (alignment & (alignment - 1)) != 0)
+      {
+        return nullptr;
+      }
+
+      //
+      // GranulesOf() would wrap around for huge sizes.
+      //
+      if (size > Granules * GranuleSize)
+      {
+        return nullptr;
+      }
+
+      uint64_t count = GranulesOf(size);
+      uint64_t step  = std::max<uint64_t>(alignment / GranuleSize, 1);
+
+      uint64_t granule = FindFreeRun(count, step);
+      if (granule == NoGranule)
+      {
+        return nullptr;
+      }
+
+      uint64_t end = (granule + count) * GranuleSize;
+      if (not _storage.Commit(end))
+      {
+        return nullptr;
+      }
+
+      SetBits(granule, count, true);
+
+      while (_firstFreeWord < Words and _used[_firstFreeWord] == AllUsed)
+      {
+        _firstFreeWord++;
+      }
+
+      return &_memory[granule * GranuleSize];
+    }
+
+    //
+    // Size must be the one block was allocated with.
+    //
+    void Free(void* ptr, uint64_t size)
+    {
+      if (not Contains(ptr) or size > Granules * GranuleSize)
+      {
+        return;
+      }
+
+      uint64_t granule = ((char*)ptr - &_memory[0]) / GranuleSize;
+      uint64_t count   = GranulesOf(size);
+
+      SetBits(granule, count, false);
+
+      _firstFreeWord = std::min(_firstFreeWord, granule / 64);
+    }
+
+    void Reset()
+    {
+      std::memset(_used, 0, sizeof(_used));
+
+      //
+      // Granules past the end of the arena are never handed out.
+      //
+      if (Granules % 64 != 0)
+      {
+        _used[Words - 1] = AllUsed << (Granules % 64);
+      }
+
+      _firstFreeWord = 0;
+    }
+
+    bool Contains(const void* ptr) const
+    {
+      const char* p = (const char*)ptr;
+      return (p >= &_memory[0] and p < &_memory[Granules * GranuleSize]);
+    }
+
+    //
+    // Walks the whole bitmap, which is 1/128 of the arena.
+    //
+    Stats GetStats() const
+    {
+      Stats st;
+
+      st.Capacity = Granules * GranuleSize;
+
+      uint64_t run = 0;
+
+      auto closeRun = [&st, &run](uint64_t extra)
+      {
+        run += extra;
+
+        if (run != 0)
+        {
+          st.FreeExtents++;
+          st.LargestFreeExtent = std::max(st.LargestFreeExtent, run * GranuleSize);
+        }
+
+        run = 0;
+      };
+
+      for (uint64_t w = 0; w < Words; w++)
+      {
+        uint64_t used = _used[w];
+
+        st.FreeBytes += (64 - __builtin_popcountll(used)) * GranuleSize;
+
+        if (used == 0)
+        {
+          run += 64;
+          continue;
+        }
+
+        closeRun(__builtin_ctzll(used));
+
+        //
+        // Holes between used bits inside the word.
+        //
+        uint64_t prev = __builtin_ctzll(used);
+        used &= used - 1;
+
+        while (used != 0)
+        {
+          uint64_t bit = __builtin_ctzll(used);
+
+          closeRun(bit - prev - 1);
+
+          prev = bit;
+          used &= used - 1;
+        }
+
+        run = 63 - prev;
+      }
+
+      closeRun(0);
+
+      st.BytesUsed = st.Capacity - st.FreeBytes;
+
+      return st;
+    }
+
+  private:
+    static const uint64_t Granules = MemorySize / GranuleSize;
+    static const uint64_t Words    = (Granules + 63) / 64;
+
+    static const uint64_t AllUsed   = UINT64_MAX;
+    static const uint64_t NoGranule = UINT64_MAX;
+
+    static_assert(Granules != 0, "Arena must hold at least one granule");
+
+    //
+    // Zero sized blocks still take a granule,
+    // so that every block has unique address.
+    //
+    static uint64_t GranulesOf(uint64_t size)
+    {
+      return std::max<uint64_t>((size + GranuleSize - 1) / GranuleSize, 1);
+    }
+
+    //
+    // Arena start is only guaranteed to be aligned to its storage,
+    // so aligned granules are counted from the first one that's
+    // aligned in memory.
+    //
+    uint64_t AlignGranule(uint64_t granule, uint64_t step) const
+    {
+      uint64_t phase = ((uintptr_t)&_memory[0] / GranuleSize + granule) % step;
+      return (phase == 0) ? granule : granule + step - phase;
+    }
+
+    //
+    // Bits of granules inside word that are aligned to step.
+    //
+    uint64_t AlignedBits(uint64_t word, uint64_t step) const
+    {
+      uint64_t first = AlignGranule(word * 64, step) - word * 64;
+
+      if (step >= 64)
+      {
+        return (first < 64) ? uint64_t(1) << first : 0;
+      }
+
+      return (AllUsed / ((uint64_t(1) << step) - 1)) << first;
+    }
+
+    //
+    // Bit i of the result is set if bits i .. i + count - 1
+    // are all set in bits, count must be below 64.
+    //
+    static uint64_t RunStarts(uint64_t bits, uint64_t count)
+    {
+      uint64_t length = 1;
+
+      while (length < count and bits != 0)
+      {
+        uint64_t shift = std::min(length, count - length);
+
+        bits   &= bits >> shift;
+        length += shift;
+      }
+
+      return bits;
+    }
+
+    //
+    // Free run is tracked across words by its first granule,
+    // runs that fit inside a single word are found with RunStarts().
+    //
+    uint64_t FindFreeRun(uint64_t count, uint64_t step)
+    {
+      uint64_t runStart = _firstFreeWord * 64;
+
+      auto fits = [&](uint64_t runEnd)
+      {
+        uint64_t start = AlignGranule(runStart, step);
+        return (start + count <= runEnd) ? start : NoGranule;
+      };
+
+      for (uint64_t w = _firstFreeWord; w < Words; w++)
+      {
+#if defined(__AVX2__)
+        if (w % 4 == 0 and w + 4 <= Words)
+        {
+          __m256i words = _mm256_loadu_si256((const __m256i*)&_used[w]);
+
+          if (_mm256_testc_si256(words, _mm256_set1_epi64x(-1)))
+          {
+            uint64_t start = fits(w * 64);
+            if (start != NoGranule)
+            {
+              return start;
+            }
+
+            runStart = (w + 4) * 64;
+            w += 3;
+
+            continue;
+          }
+        }
+#endif
+
+        uint64_t used = _used[w];
+        uint64_t base = w * 64;
+
+        uint64_t start = fits(base + ((used == 0) ? 64 : __builtin_ctzll(used)));
+        if (start != NoGranule)
+        {
+          return start;
+        }
+
+        if (used == 0)
+        {
+          continue;
+        }
+
+        if (count < 64)
+        {
+          uint64_t starts = RunStarts(~used, count) & AlignedBits(w, step);
+          if (starts != 0)
+          {
+            return base + __builtin_ctzll(starts);
+          }
+        }
+
+        runStart = base + 64 - __builtin_clzll(used);
+      }
+
+      return fits(Words * 64);
+    }
+
+    void SetBits(uint64_t granule, uint64_t count, bool used)
+    {
+      while (count != 0)
+      {
+        uint64_t w     = granule / 64;
+        uint64_t bit   = granule % 64;
+        uint64_t width = std::min(count, 64 - bit);
+
+        uint64_t mask = (width == 64)
+                      ? AllUsed
+                      : ((uint64_t(1) << width) - 1) << bit;
+
+        if (used)
+        {
+          _used[w] |= mask;
+        }
+        else
+        {
+          _used[w] &= ~mask;
+        }
+
+        granule += width;
+        count   -= width;
+      }
+    }
+
+    Storage<MemorySize> _storage;
+
+    char* _memory = _storage.Data();
+
+    uint64_t _used[Words];
+
+    //
+    // Every word before this one is full.
+    //
+    uint64_t _firstFreeWord = 0;
+};
+
+#endif // include guard
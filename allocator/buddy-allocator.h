@@ -0,0 +1,407 @@
+#ifndef BUDDY_ALLOCATOR_H
+#define BUDDY_ALLOCATOR_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+//
+// Buddy system allocator.
+//
+// Arena is a power of two and every block is MinBlockSize << order.
+// Alloc() splits bigger blocks in halves until requested order is reached,
+// Free() merges block with its buddy for as long as the buddy is free.
+// Free blocks of each order are marked in per-order bitmap,
+// so buddy check is a single bit test.
+//
+// Block header with BlockInfo lives in the arena right before the payload.
+//
+template <uint64_t MemorySize>
+class BuddyAllocator
+{
+  public:
+    struct BlockInfo
+    {
+      uint64_t Id   = 0;
+      void* Addr    = nullptr;
+      uint64_t Size = 0;
+    };
+
+    BuddyAllocator(const std::string& tag = std::string())
+    {
+      _blockUniqueId = 1;
+
+      Reset();
+
+      if (not tag.empty())
+      {
+        _tag = tag;
+
+        printf("[BuddyAllocator '%s']\n", _tag.data());
+      }
+
+      printf("Memory range: [%p - %p]\n\n",
+             &_memory[0], &_memory[MemorySize - 1]);
+    }
+
+    //
+    // Free lists point into the arena inside the object.
+    //
+    BuddyAllocator(const BuddyAllocator&) = delete;
+    BuddyAllocator& operator=(const BuddyAllocator&) = delete;
+
+    const BlockInfo& Alloc(uint64_t size)
+    {
+      int order = OrderFor(size);
+      if (order > MaxOrder)
+      {
+        return _nullReference;
+      }
+
+      //
+      // Smallest non-empty order that fits.
+      //
+      uint64_t orders = _orderMask & (~uint64_t(0) << order);
+      if (orders == 0)
+      {
+        return _nullReference;
+      }
+
+      int from = __builtin_ctzll(orders);
+
+      BlockHeader* block = _freeLists[from];
+      RemoveFreeBlock(block, from);
+
+      SplitDown(block, from, order);
+
+      block->Order     = order;
+      block->IsFree    = false;
+      block->Info.Id   = _blockUniqueId++;
+      block->Info.Addr = (char*)block + HeaderSize;
+      block->Info.Size = size;
+
+      return block->Info;
+    };
+
+    const BlockInfo& ReAlloc(const BlockInfo& bi, uint64_t size)
+    {
+      BlockHeader* block = FindBlock(bi);
+      if (block == nullptr)
+      {
+        return _nullReference;
+      }
+
+      int order = OrderFor(size);
+
+      if (order <= (int)block->Order)
+      {
+        SplitDown(block, block->Order, order);
+        block->Order     = order;
+        block->Info.Size = size;
+        return block->Info;
+      }
+
+      if (CanGrowInPlace(block, order))
+      {
+        for (int o = block->Order; o < order; o++)
+        {
+          BlockHeader* buddy = Buddy(block, o);
+          RemoveFreeBlock(buddy, o);
+        }
+
+        block->Order     = order;
+        block->Info.Size = size;
+        return block->Info;
+      }
+
+      const BlockInfo& newBlock = Alloc(size);
+      if (newBlock.Addr == nullptr)
+      {
+        return _nullReference;
+      }
+
+      std::memcpy(newBlock.Addr,
+                  block->Info.Addr,
+                  std::min(block->Info.Size, size));
+
+      Free(block->Info);
+
+      return newBlock;
+    };
+
+    void Free(const BlockInfo& blockToFree)
+    {
+      BlockHeader* block = FindBlock(blockToFree);
+      if (block == nullptr)
+      {
+        return;
+      }
+
+      std::memset(block->Info.Addr, 0, block->Info.Size);
+
+      block->Info = _nullReference;
+
+      int order = block->Order;
+
+      while (order < MaxOrder)
+      {
+        BlockHeader* buddy = Buddy(block, order);
+        if (not IsFreeAt(buddy, order))
+        {
+          break;
+        }
+
+        RemoveFreeBlock(buddy, order);
+
+        block = std::min(block, buddy);
+        order++;
+      }
+
+      InsertFreeBlock(block, order);
+    };
+
+    void Reset()
+    {
+      std::memset(&_memory, 0, MemorySize);
+      std::memset(_freeBitmap, 0, sizeof(_freeBitmap));
+      std::memset(_freeLists, 0, sizeof(_freeLists));
+
+      _orderMask = 0;
+
+      InsertFreeBlock((BlockHeader*)&_memory[0], MaxOrder);
+    }
+
+  private:
+    struct BlockHeader
+    {
+      BlockInfo Info;
+      uint32_t Order  = 0;
+      uint32_t IsFree = 0;
+    };
+
+    //
+    // Free blocks keep list links right after the header.
+    //
+    struct FreeLinks
+    {
+      BlockHeader* Next = nullptr;
+      BlockHeader* Prev = nullptr;
+    };
+
+    static constexpr int Log2(uint64_t value)
+    {
+      return (value == 0) ? -1 : 63 - __builtin_clzll(value);
+    }
+
+    static constexpr int MinBlockLog2   = 6;
+    static constexpr uint64_t MinBlockSize = uint64_t(1) << MinBlockLog2;
+    static constexpr uint64_t HeaderSize   = sizeof(BlockHeader);
+
+    static_assert(HeaderSize + sizeof(FreeLinks) <= MinBlockSize,
+                  "Minimal block can't hold free block header");
+
+    //
+    // Anything past the biggest power of two is left unused.
+    //
+    static constexpr uint64_t ArenaSize = uint64_t(1) << Log2(MemorySize);
+
+    static_assert(ArenaSize >= MinBlockSize, "Arena is too small");
+
+    static constexpr int MaxOrder = Log2(ArenaSize) - MinBlockLog2;
+    static constexpr uint64_t MinBlocks = ArenaSize >> MinBlockLog2;
+
+    //
+    // Order k uses (MinBlocks >> k) bits,
+    // all orders are packed one after another.
+    //
+    static constexpr uint64_t BitmapBits  = 2 * MinBlocks;
+    static constexpr uint64_t BitmapWords = (BitmapBits + 63) / 64;
+
+    static uint64_t BitIndex(uint64_t offset, int order)
+    {
+      uint64_t orderStart = BitmapBits - (BitmapBits >> order);
+      return orderStart + (offset >> (MinBlockLog2 + order));
+    }
+
+    //
+    // Sizes that can't fit the arena map past MaxOrder,
+    // before size + HeaderSize gets a chance to wrap around.
+    //
+    int OrderFor(uint64_t size)
+    {
+      if (size > ArenaSize - HeaderSize)
+      {
+        return MaxOrder + 1;
+      }
+
+      uint64_t total = size + HeaderSize;
+      if (total <= MinBlockSize)
+      {
+        return 0;
+      }
+
+      return Log2(total - 1) + 1 - MinBlockLog2;
+    }
+
+    uint64_t OffsetOf(BlockHeader* block)
+    {
+      return (char*)block - &_memory[0];
+    }
+
+    BlockHeader* Buddy(BlockHeader* block, int order)
+    {
+      uint64_t offset = OffsetOf(block) ^ (MinBlockSize << order);
+      return (BlockHeader*)&_memory[offset];
+    }
+
+    FreeLinks& Links(BlockHeader* block)
+    {
+      return *(FreeLinks*)((char*)block + HeaderSize);
+    }
+
+    bool IsFreeAt(BlockHeader* block, int order)
+    {
+      uint64_t bit = BitIndex(OffsetOf(block), order);
+      return (_freeBitmap[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    void SetFreeAt(BlockHeader* block, int order, bool isFree)
+    {
+      uint64_t bit  = BitIndex(OffsetOf(block), order);
+      uint64_t mask = uint64_t(1) << (bit % 64);
+
+      if (isFree)
+      {
+        _freeBitmap[bit / 64] |= mask;
+      }
+      else
+      {
+        _freeBitmap[bit / 64] &= ~mask;
+      }
+    }
+
+    BlockHeader* FindBlock(const BlockInfo& bi)
+    {
+      char* p = (char*)bi.Addr;
+      if (bi.Id == 0
+       or p < &_memory[HeaderSize]
+       or p >= &_memory[ArenaSize]
+       or (p - &_memory[HeaderSize]) % MinBlockSize != 0)
+      {
+        return nullptr;
+      }
+
+      BlockHeader* block = (BlockHeader*)(p - HeaderSize);
+      if (block->IsFree or block->Info.Id != bi.Id)
+      {
+        return nullptr;
+      }
+
+      return block;
+    }
+
+    //
+    // Halves the block from order 'from' down to order 'to',
+    // returning upper halves to free lists.
+    //
+    void SplitDown(BlockHeader* block, int from, int to)
+    {
+      while (from > to)
+      {
+        from--;
+
+        BlockHeader* upper = Buddy(block, from);
+        upper->Info = _nullReference;
+        InsertFreeBlock(upper, from);
+      }
+    }
+
+    //
+    // Growing in place is possible when the block is the lower buddy
+    // on every level up to requested order and all upper buddies are free.
+    //
+    bool CanGrowInPlace(BlockHeader* block, int order)
+    {
+      if (order > MaxOrder)
+      {
+        return false;
+      }
+
+      for (int o = block->Order; o < order; o++)
+      {
+        BlockHeader* buddy = Buddy(block, o);
+        if (buddy < block or not IsFreeAt(buddy, o))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    void InsertFreeBlock(BlockHeader* block, int order)
+    {
+      block->Order  = order;
+      block->IsFree = 1;
+
+      FreeLinks& links = Links(block);
+      links.Prev = nullptr;
+      links.Next = _freeLists[order];
+
+      if (links.Next != nullptr)
+      {
+        Links(links.Next).Prev = block;
+      }
+
+      _freeLists[order] = block;
+      _orderMask |= (uint64_t(1) << order);
+
+      SetFreeAt(block, order, true);
+    }
+
+    void RemoveFreeBlock(BlockHeader* block, int order)
+    {
+      FreeLinks& links = Links(block);
+
+      if (links.Prev != nullptr)
+      {
+        Links(links.Prev).Next = links.Next;
+      }
+      else
+      {
+        _freeLists[order] = links.Next;
+      }
+
+      if (links.Next != nullptr)
+      {
+        Links(links.Next).Prev = links.Prev;
+      }
+
+      links = FreeLinks();
+
+      if (_freeLists[order] == nullptr)
+      {
+        _orderMask &= ~(uint64_t(1) << order);
+      }
+
+      block->IsFree = 0;
+
+      SetFreeAt(block, order, false);
+    }
+
+    alignas(MinBlockSize) char _memory[MemorySize];
+
+    uint64_t _freeBitmap[BitmapWords];
+    BlockHeader* _freeLists[MaxOrder + 1];
+    uint64_t _orderMask = 0;
+
+    const BlockInfo _nullReference = { 0, nullptr, 0 };
+
+    std::string _tag;
+
+    uint64_t _blockUniqueId = 0;
+};
+
+#endif // include guard
@@ -0,0 +1,340 @@
+#ifndef CONCURRENT_ALLOCATOR_H
+#define CONCURRENT_ALLOCATOR_H
+
+#include "tlsf-allocator.h"
+
+#include <cstdint>
+#include <mutex>
+
+//
+// Shared arena with per-thread caches in front of it.
+//
+// Every thread creates its own ThreadCache, which keeps a small
+// magazine of free blocks per size class. Alloc() and Free() on the cache
+// don't take any locks as long as magazine is neither empty nor full,
+// otherwise BatchSize blocks are moved from / to the central arena
+// under a single lock. Blocks bigger than the biggest size class
+// go to the central arena directly.
+//
+// Block may be freed through any thread's cache.
+//
+// Blocks are 16 byte aligned, bigger alignment is served
+// by the central arena with AllocAligned().
+//
+template <uint64_t MemorySize,
+          template <uint64_t> class Storage = InlineStorage>
+class ConcurrentAllocator
+{
+  public:
+    //
+    // Size classes are powers of two from 16 to 1024 bytes.
+    //
+    static const uint64_t SizeClasses  = 7;
+    static const uint64_t MinClassLog2 = 4;
+    static const uint64_t MaxClassSize = uint64_t(1)
+                                      << (MinClassLog2 + SizeClasses - 1);
+
+    static const uint64_t MagazineSize = 64;
+    static const uint64_t BatchSize    = MagazineSize / 2;
+
+    static const uint64_t MinAlignment = 16;
+
+    class ThreadCache
+    {
+      public:
+        ThreadCache(ConcurrentAllocator& owner)
+          : _owner(owner)
+        {
+        }
+
+        ~ThreadCache()
+        {
+          Flush();
+        }
+
+        ThreadCache(const ThreadCache&) = delete;
+        ThreadCache& operator=(const ThreadCache&) = delete;
+
+        void* Alloc(uint64_t size)
+        {
+          if (size > MaxClassSize)
+          {
+            return _owner.Alloc(size);
+          }
+
+          uint64_t cls = SizeClassOf(size);
+          Magazine& mag = _magazines[cls];
+
+          if (mag.Count == 0)
+          {
+            mag.Count = _owner.AllocBatch(cls, mag.Blocks, BatchSize);
+            if (mag.Count == 0)
+            {
+              return nullptr;
+            }
+          }
+
+          return mag.Blocks[--mag.Count];
+        }
+
+        void Free(void* ptr)
+        {
+          if (ptr == nullptr)
+          {
+            return;
+          }
+
+          uint64_t cls = PrefixOf(ptr)->SizeClass;
+          if (cls == LargeBlock or cls == AlignedBlock)
+          {
+            _owner.Free(ptr);
+            return;
+          }
+
+          Magazine& mag = _magazines[cls];
+
+          if (mag.Count == MagazineSize)
+          {
+            mag.Count -= BatchSize;
+            _owner.FreeBatch(&mag.Blocks[mag.Count], BatchSize);
+          }
+
+          mag.Blocks[mag.Count++] = ptr;
+        }
+
+        //
+        // Returns all cached blocks to the central arena.
+        //
+        void Flush()
+        {
+          for (auto& mag : _magazines)
+          {
+            _owner.FreeBatch(mag.Blocks, mag.Count);
+            mag.Count = 0;
+          }
+        }
+
+      private:
+        struct Magazine
+        {
+          void* Blocks[MagazineSize];
+          uint64_t Count = 0;
+        };
+
+        ConcurrentAllocator& _owner;
+
+        Magazine _magazines[SizeClasses];
+    };
+
+    //
+    // Slow path, always takes the lock.
+    //
+    void* Alloc(uint64_t size)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return AllocLocked(size, LargeBlock);
+    }
+
+    //
+    // Alignment must be power of two.
+    //
+    void* AllocAligned(uint64_t size, uint64_t alignment)
+    {
+      if (alignment <= MinAlignment)
+      {
+        return Alloc(size);
+      }
+
+      if (size > MemorySize or alignment > MemorySize)
+      {
+        return nullptr;
+      }
+
+      void* base = Alloc(size + alignment);
+      if (base == nullptr)
+      {
+        return nullptr;
+      }
+
+      uintptr_t aligned = ((uintptr_t)base + alignment - 1)
+                        & ~(uintptr_t)(alignment - 1);
+
+      if (aligned == (uintptr_t)base)
+      {
+        return base;
+      }
+
+      //
+      // Gap is at least MinAlignment, so there's always room
+      // for a prefix that leads back to the real block.
+      //
+      BlockPrefix* prefix = PrefixOf((void*)aligned);
+      prefix->Id        = aligned - (uintptr_t)base;
+      prefix->SizeClass = AlignedBlock;
+      prefix->Size      = size;
+
+      return (void*)aligned;
+    }
+
+    void Free(void* ptr)
+    {
+      if (ptr == nullptr)
+      {
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(_mutex);
+      FreeLocked(ptr);
+    }
+
+    //
+    // How many bytes can be used in the block,
+    // at least as many as were requested.
+    //
+    static uint64_t UsableSize(void* ptr)
+    {
+      if (ptr == nullptr)
+      {
+        return 0;
+      }
+
+      BlockPrefix* prefix = PrefixOf(ptr);
+
+      if (prefix->SizeClass == LargeBlock or prefix->SizeClass == AlignedBlock)
+      {
+        return prefix->Size;
+      }
+
+      return uint64_t(1) << (MinClassLog2 + prefix->SizeClass);
+    }
+
+    //
+    // True if block came from this allocator.
+    //
+    bool Owns(void* ptr) const
+    {
+      return _arena.Contains(ptr);
+    }
+
+  private:
+    static const uint64_t LargeBlock   = 0xFF;
+    static const uint64_t AlignedBlock = 0xFE;
+
+    //
+    // Stored in front of every block, so that Free()
+    // knows size class and central arena block id.
+    //
+    // Aligned block has another prefix right before the returned
+    // pointer, with offset to the real block in place of id.
+    //
+    struct BlockPrefix
+    {
+      uint64_t Id            = 0;
+      uint64_t SizeClass : 8;
+      uint64_t Size      : 56;
+    };
+
+    static_assert(sizeof(BlockPrefix) == MinAlignment,
+                  "Block prefix must keep payload aligned");
+
+    using Arena = TlsfAllocator<MemorySize, Storage>;
+
+    static uint64_t SizeClassOf(uint64_t size)
+    {
+      if (size <= (uint64_t(1) << MinClassLog2))
+      {
+        return 0;
+      }
+
+      return 64 - __builtin_clzll(size - 1) - MinClassLog2;
+    }
+
+    static BlockPrefix* PrefixOf(void* ptr)
+    {
+      return (BlockPrefix*)ptr - 1;
+    }
+
+    uint64_t AllocBatch(uint64_t cls, void** blocks, uint64_t count)
+    {
+      uint64_t size = uint64_t(1) << (MinClassLog2 + cls);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      uint64_t allocated = 0;
+
+      while (allocated < count)
+      {
+        void* ptr = AllocLocked(size, cls);
+        if (ptr == nullptr)
+        {
+          break;
+        }
+
+        blocks[allocated++] = ptr;
+      }
+
+      return allocated;
+    }
+
+    void FreeBatch(void** blocks, uint64_t count)
+    {
+      if (count == 0)
+      {
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      for (uint64_t i = 0; i < count; i++)
+      {
+        FreeLocked(blocks[i]);
+      }
+    }
+
+    //
+    // Sizes are checked before the prefix is added,
+    // so that huge requests can't wrap around.
+    //
+    void* AllocLocked(uint64_t size, uint64_t cls)
+    {
+      if (size > MemorySize)
+      {
+        return nullptr;
+      }
+
+      const auto& bi = _arena.Alloc(size + sizeof(BlockPrefix));
+      if (bi.Addr == nullptr)
+      {
+        return nullptr;
+      }
+
+      BlockPrefix* prefix = (BlockPrefix*)bi.Addr;
+      prefix->Id        = bi.Id;
+      prefix->SizeClass = cls;
+      prefix->Size      = size;
+
+      return prefix + 1;
+    }
+
+    void FreeLocked(void* ptr)
+    {
+      BlockPrefix* prefix = PrefixOf(ptr);
+
+      if (prefix->SizeClass == AlignedBlock)
+      {
+        prefix = PrefixOf((char*)ptr - prefix->Id);
+      }
+
+      typename Arena::BlockInfo bi;
+      bi.Id   = prefix->Id;
+      bi.Addr = prefix;
+
+      _arena.Free(bi);
+    }
+
+    std::mutex _mutex;
+
+    Arena _arena;
+};
+
+#endif // include guard
@@ -0,0 +1,161 @@
+#ifndef FRAME_ALLOCATOR_H
+#define FRAME_ALLOCATOR_H
+
+#include "arena-storage.h"
+
+#include <cstdint>
+
+//
+// Stack allocator for scoped scratch memory.
+//
+// Alloc() only bumps the index, there is no per-block bookkeeping
+// and no Free(): memory is released in LIFO order by rewinding
+// to a marker taken earlier, either by hand or with Scope.
+//
+template <uint64_t MemorySize,
+          template <uint64_t> class Storage = InlineStorage>
+class FrameAllocator
+{
+  public:
+    using Marker = uint64_t;
+
+    static const uint64_t DefaultAlignment = 16;
+
+    FrameAllocator() = default;
+
+    FrameAllocator(const FrameAllocator&) = delete;
+    FrameAllocator& operator=(const FrameAllocator&) = delete;
+
+    //
+    // Returns nullptr when arena is exhausted.
+    // Alignment must be power of two.
+    //
+    void* Alloc(uint64_t size, uint64_t alignment = DefaultAlignment)
+    {
+      char* memory = _storage.Data();
+
+      uintptr_t addr    = (uintptr_t)memory + _index;
+      uintptr_t aligned = (addr + alignment - 1)
+                        & ~(uintptr_t)(alignment - 1);
+
+      uint64_t offset = _index + (aligned - addr);
+
+      if (offset > MemorySize
+       or size > MemorySize - offset
+       or not _storage.Commit(offset + size))
+      {
+        return nullptr;
+      }
+
+      _index = offset + size;
+
+      return &memory[offset];
+    }
+
+    Marker GetMarker() const
+    {
+      return _index;
+    }
+
+    //
+    // Releases everything allocated after the marker was taken.
+    //
+    void FreeToMarker(Marker marker)
+    {
+      if (marker < _index)
+      {
+        _index = marker;
+      }
+    }
+
+    void Reset()
+    {
+      _index = 0;
+    }
+
+    uint64_t BytesUsed() const
+    {
+      return _index;
+    }
+
+    //
+    // Rewinds allocator to where it was when the scope was entered.
+    //
+    class Scope
+    {
+      public:
+        Scope(FrameAllocator& allocator)
+          : _allocator(allocator),
+            _marker(allocator.GetMarker())
+        {
+        }
+
+        ~Scope()
+        {
+          _allocator.FreeToMarker(_marker);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+      private:
+        FrameAllocator& _allocator;
+        Marker _marker;
+    };
+
+  private:
+    Storage<MemorySize> _storage;
+
+    uint64_t _index = 0;
+};
+
+// =============================================================================
+
+//
+// Two frame allocators used in turns.
+//
+// Data allocated during a frame stays valid through the next one
+// and is released by the second SwapFrames() after it was allocated,
+// so results of one tick can be read by the next without copying.
+//
+template <uint64_t MemorySize,
+          template <uint64_t> class Storage = InlineStorage>
+class DoubleBufferedFrameAllocator
+{
+  public:
+    using Frame = FrameAllocator<MemorySize, Storage>;
+
+    static const uint64_t DefaultAlignment = Frame::DefaultAlignment;
+
+    void* Alloc(uint64_t size, uint64_t alignment = DefaultAlignment)
+    {
+      return _frames[_current].Alloc(size, alignment);
+    }
+
+    //
+    // Makes current frame previous one and clears
+    // the frame before it, which becomes current.
+    //
+    void SwapFrames()
+    {
+      _current ^= 1;
+      _frames[_current].Reset();
+    }
+
+    Frame& CurrentFrame()
+    {
+      return _frames[_current];
+    }
+
+    Frame& PreviousFrame()
+    {
+      return _frames[_current ^ 1];
+    }
+
+  private:
+    Frame _frames[2];
+
+    uint32_t _current = 0;
+};
+
+#endif // include guard
@@ -1,330 +1,857 @@
+#include "smart-allocator.h"
+#include "small-allocator.h"
+#include "tlsf-allocator.h"
+#include "buddy-allocator.h"
+#include "concurrent-allocator.h"
+#include "atomic-arena.h"
+#include "pmr-resource.h"
+#include "object-pool.h"
+#include "frame-allocator.h"
+#include "bitmap-allocator.h"
+
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
-#include <map>
-#include <string>
+#include <new>
+#include <random>
+#include <thread>
+#include <vector>
 
-template <uint64_t MemorySize>
-class SmartAllocator
+void FillBuffer(char* begin, size_t size)
 {
-  public:
-    struct BlockInfo
-    {
-      uint64_t Id   = 0;
-      void* Addr    = nullptr;
-      uint64_t Size = 0;
-    };
+  for (size_t i = 0; i < size; i++)
+  {
+    begin[i] = (i == size - 1) ? 255 : i;
+  }
+}
 
-    SmartAllocator(const std::string& tag = std::string())
+void FillBuffer(char* begin, size_t size, char value)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    begin[i] = (i == size - 1) ? 255 : value;
+  }
+}
+
+bool IsZero(const void* begin, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    if (((const char*)begin)[i] != 0)
     {
-      _blockUniqueId = 1;
+      return false;
+    }
+  }
 
-      Reset();
+  return true;
+}
 
-      if (not tag.empty())
-      {
-        _tag = tag;
+// =============================================================================
 
-        printf("[SmartAllocator '%s']\n", _tag.data());
-      }
+int main()
+{
+  const size_t blockSize = sizeof(int);
 
-      printf("Memory range: [0x%X - 0x%X]\n\n",
-             &_memory[0], &_memory[MemorySize - 1]);
-    }
+  SmallAllocator a;
 
-    const BlockInfo& Alloc(uint64_t size)
-    {
-      if (_index + size >= MemorySize)
-      {
-        return _nullReference;
-      }
+  char* p1 = (char*)a.Alloc(blockSize);
+  FillBuffer(p1, blockSize);
+  char* p2 = (char*)a.Alloc(4 * blockSize);
+  FillBuffer(p2, 4 * blockSize);
+  char* p3 = (char*)a.Alloc(2 * blockSize);
+  FillBuffer(p3, 2 * blockSize);
 
-      void* addr = &_memory[_index];
-      _index += size;
+  a.Free(p2);
 
-      BlockInfo bi;
-      bi.Id   = _blockUniqueId++;
-      bi.Addr = addr;
-      bi.Size = size;
+  //
+  // Freed block goes to the size class free list,
+  // so it is reused without defragmentation.
+  //
+  char* p4 = (char*)a.Alloc(3 * blockSize);
+  FillBuffer(p4, 3 * blockSize);
 
-      _blockInfoById[bi.Id] = bi;
+  a.Free(p4);
 
-      return _blockInfoById.at(bi.Id);
-    };
+  //
+  // Requests that can't fit the arena fail
+  // and leave the block as it was.
+  //
+  if (a.Alloc(1000) != nullptr
+   or a.ReAlloc(p1, 1000) != nullptr
+   or a.ReAlloc(p1, UINT64_MAX) != nullptr
+   or (unsigned char)p1[blockSize - 1] != 255)
+  {
+    std::cout << "SMALL OVERSIZE ERROR" << std::endl;
+  }
 
-    const BlockInfo& ReAlloc(const BlockInfo& bi, uint64_t size)
-    {
-      if (_index + size >= MemorySize)
-      {
-        return _nullReference;
-      }
+  //
+  // FIXME: all raw pointers to previously allocated memory
+  // are now invalid!
+  //
+  a.Defragment();
 
-      if (_blockInfoById.count(bi.Id) != 1)
-      {
-        return _nullReference;
-      }
+  SmartAllocator<64> sa("SmartAlloc1");
+
+  auto sp1 = sa.Alloc(blockSize);
+  auto bi  = sa.Get(sp1);
+  FillBuffer((char*)bi.Addr, bi.Size);
+  auto sp2 = sa.Alloc(4 * blockSize);
+  bi = sa.Get(sp2);
+  FillBuffer((char*)bi.Addr, bi.Size);
+  auto sp3 = sa.Alloc(2 * blockSize);
+  bi = sa.Get(sp3);
+  FillBuffer((char*)bi.Addr, bi.Size);
+
+  sa.Free(sp2);
+
+  sa.Defragment();
+
+  //
+  // sp2 is stale now, so Get() returns placeholder value
+  // of 0 size buffer and for loop won't even start.
+  //
+  // In reality one should check BlockInfo::Addr against nullptr.
+  //
+  bi = sa.Get(sp2);
+  FillBuffer((char*)bi.Addr, bi.Size, 32);
 
-      const BlockInfo& oldBlock = _blockInfoById.at(bi.Id);
-      void* oldAddr = oldBlock.Addr;
+  //
+  // sp3 was moved by Defragment(), but handle still resolves.
+  //
+  bi = sa.Get(sp3);
+  FillBuffer((char*)bi.Addr, bi.Size, 64);
+
+  //
+  // Handle stays valid after realloc too.
+  //
+  sp3 = sa.ReAlloc(sp3, 3 * blockSize);
+  bi  = sa.Get(sp3);
+  FillBuffer((char*)bi.Addr, bi.Size);
+
+  auto sp4 = sa.Alloc(3 * blockSize);
+  bi = sa.Get(sp4);
+  FillBuffer((char*)bi.Addr, bi.Size);
+
+  //
+  // Requests that can't fit the arena fail
+  // and don't disturb blocks already there.
+  //
+  if (not sa.Alloc(UINT64_MAX).IsNull()
+   or not sa.Alloc(UINT64_MAX - 8, 16).IsNull()
+   or not sa.Alloc(64).IsNull()
+   or not sa.ReAlloc(sp4, UINT64_MAX - 4).IsNull()
+   or not sa.ReAlloc(sp4, UINT64_MAX - 4, 16).IsNull()
+   or sa.Get(sp4).Size != 3 * blockSize
+   or ((unsigned char*)sa.Get(sp4).Addr)[3 * blockSize - 1] != 255)
+  {
+    std::cout << "SMART OVERSIZE ERROR" << std::endl;
+  }
 
-      auto oldBlockSize = oldBlock.Size;
+  sa.Free(sp3);
 
-      void* newAddr = &_memory[_index];
+  //
+  // Compact arena a few bytes at a time.
+  //
+  while (not sa.DefragmentStep(blockSize))
+  {
+  }
 
-      BlockInfo newBlock;
-      newBlock.Id   = _blockUniqueId++;
-      newBlock.Addr = newAddr;
-      newBlock.Size = size;
+  //
+  // Blocks can change between steps. Here the last compacted block
+  // shrinks to nothing after the cursor block is gone, so the block
+  // allocated next lands below where compaction stopped
+  // and must not be moved up by the following step.
+  //
+  SmartAllocator<1024> da("DefragMutations");
 
-      _blockInfoById[newBlock.Id] = newBlock;
+  auto df = da.Alloc(16);
+  auto dx = da.Alloc(64);
+  auto dy = da.Alloc(64);
 
-      _index += size;
+  da.Free(df);
+  da.DefragmentStep(1);
+  da.Free(dy);
 
-      std::memcpy(newAddr, oldAddr, oldBlockSize);
+  dx = da.ReAlloc(dx, 0);
 
-      Free(oldBlock);
+  auto dw = da.Alloc(32);
+  FillBuffer((char*)da.Get(dw).Addr, 32, 7);
 
-      return _blockInfoById.at(newBlock.Id);
-    };
+  while (not da.DefragmentStep(1))
+  {
+  }
+
+  auto dwi = da.Get(dw);
+  if (((char*)dwi.Addr)[0] != 7 or ((unsigned char*)dwi.Addr)[31] != 255)
+  {
+    std::cout << "DEFRAGMENT STEP ERROR" << std::endl;
+  }
 
-    void Free(const BlockInfo& blockToFree)
+  //
+  // Steps interleaved with random Alloc(), ReAlloc() and Free(),
+  // zero sized blocks included, over a few seeds. Every block
+  // is filled with its own value, which must survive all the moves.
+  //
+  using StepArena = SmartAllocator<64 * 1024>;
+
+  struct StepBlock
+  {
+    StepArena::Handle Handle;
+    uint64_t Size = 0;
+    char Value    = 0;
+  };
+
+  bool intact = true;
+
+  for (uint32_t seed = 1; seed <= 16 and intact; seed++)
+  {
+    StepArena ma;
+
+    std::vector<StepBlock> stepBlocks;
+    std::mt19937 rng(seed);
+
+    for (int i = 0; i < 300 and intact; i++)
     {
-      if (_blockInfoById.count(blockToFree.Id) == 1)
+      uint32_t op = rng() % 10;
+
+      if (op < 4 or stepBlocks.empty())
       {
-        const BlockInfo& bi = _blockInfoById.at(blockToFree.Id);
-
-        std::memset(blockToFree.Addr, 0, bi.Size);
-        //
-        // We need to make "null reference",
-        // otherwise even after erase old values will persist.
-        //
-        _blockInfoById[blockToFree.Id] = _nullReference;
-        _blockInfoById.erase(blockToFree.Id);
+        StepBlock b;
+        b.Size   = (rng() % 4 == 0) ? 0 : rng() % 300;
+        b.Value  = (char)rng();
+        b.Handle = ma.Alloc(b.Size, uint64_t(1) << (rng() % 5));
+
+        if (not b.Handle.IsNull())
+        {
+          std::memset(ma.Get(b.Handle).Addr, b.Value, b.Size);
+          stepBlocks.push_back(b);
+        }
       }
-    };
-
-    void Reset()
-    {
-      _blockInfoById.clear();
-      std::memset(&_memory, 0, MemorySize);
-      _index = 0;
-    }
+      else if (op < 6)
+      {
+        StepBlock& b = stepBlocks[rng() % stepBlocks.size()];
 
-    void Defragment()
-    {
-      void* addr = &_memory;
-      uint64_t index = 0;
+        uint64_t size = (rng() % 4 == 0) ? 0 : rng() % 300;
 
-      size_t blocks = _blockInfoById.size();
+        auto h = ma.ReAlloc(b.Handle, size);
+        if (not h.IsNull())
+        {
+          b.Handle = h;
+          b.Size   = size;
 
-      for (size_t i = 0; i < blocks; i++)
+          std::memset(ma.Get(h).Addr, b.Value, size);
+        }
+      }
+      else if (op < 8)
       {
-        auto it = _blockInfoById.begin();
-        std::advance(it, i);
+        uint64_t victim = rng() % stepBlocks.size();
 
-        BlockInfo& bi = it->second;
-        std::memcpy(addr, bi.Addr, bi.Size);
-        bi.Addr = addr;
+        ma.Free(stepBlocks[victim].Handle);
 
-        index += bi.Size;
-        addr = &_memory[index];
+        stepBlocks[victim] = stepBlocks.back();
+        stepBlocks.pop_back();
+      }
+      else
+      {
+        ma.DefragmentStep(uint64_t(rng() % 600));
       }
 
-      _index = index;
-
-      std::memset(addr, 0, MemorySize - index);
+      for (const auto& b : stepBlocks)
+      {
+        auto info = ma.Get(b.Handle);
+
+        for (uint64_t k = 0; k < b.Size; k++)
+        {
+          if (((char*)info.Addr)[k] != b.Value)
+          {
+            intact = false;
+          }
+        }
+      }
     }
+  }
 
-  private:
-    char _memory[MemorySize];
-    uint64_t _index = 0;
+  if (not intact)
+  {
+    std::cout << "DEFRAGMENT MUTATION ERROR" << std::endl;
+  }
 
-    std::map<uint64_t, BlockInfo> _blockInfoById;
+  //
+  // Same thing, but slot table is allocated once,
+  // so there are no heap allocations behind the scenes.
+  //
+  SmartAllocator<64, 8> st("SmartAlloc2");
 
-    const BlockInfo _nullReference = { 0, nullptr, 0 };
+  auto st1 = st.Alloc(blockSize);
+  auto st2 = st.Alloc(4 * blockSize);
+  auto st3 = st.Alloc(2 * blockSize);
 
-    std::string _tag;
+  st.Free(st2);
 
-    uint64_t _blockUniqueId = 0;
-};
+  st.Defragment();
 
-// =============================================================================
+  st3 = st.ReAlloc(st3, 3 * blockSize);
+  auto sti = st.Get(st3);
+  FillBuffer((char*)sti.Addr, sti.Size, 64);
 
-class SmallAllocator
-{
-  public:
-    SmallAllocator()
-    {
-      Reset();
+  st.Free(st1);
+  st.Free(st3);
 
-      /*
-      printf("Memory range: [0x%X - 0x%X]\n\n",
-             &_memory[0], &_memory[MemorySize - 1]);
-      */
-    }
+  st.Defragment();
+
+  //
+  // TLSF never moves blocks, freed space is reused right away.
+  //
+  TlsfAllocator<1024> ta("TlsfAlloc");
+
+  const auto& tp1 = ta.Alloc(blockSize);
+  FillBuffer((char*)tp1.Addr, tp1.Size);
+  const auto& tp2 = ta.Alloc(4 * blockSize);
+  FillBuffer((char*)tp2.Addr, tp2.Size);
+  const auto& tp3 = ta.Alloc(2 * blockSize);
+  FillBuffer((char*)tp3.Addr, tp3.Size);
+
+  ta.Free(tp2);
+
+  const auto& tp4 = ta.ReAlloc(tp1, 3 * blockSize);
+  FillBuffer((char*)tp4.Addr, tp4.Size);
+
+  ta.Free(tp3);
+  ta.Free(tp4);
+
+  //
+  // Buddy allocator grows block in place while its buddy is free.
+  //
+  BuddyAllocator<1024> ba("BuddyAlloc");
+
+  const auto& bp1 = ba.Alloc(blockSize);
+  FillBuffer((char*)bp1.Addr, bp1.Size);
+  const auto& bp2 = ba.ReAlloc(bp1, 16 * blockSize);
+  FillBuffer((char*)bp2.Addr, bp2.Size);
+  const auto& bp3 = ba.Alloc(2 * blockSize);
+  FillBuffer((char*)bp3.Addr, bp3.Size);
+
+  ba.Free(bp2);
+  ba.Free(bp3);
+
+  //
+  // Threads share one arena, but go through their own caches.
+  //
+  static ConcurrentAllocator<64 * 1024> ca;
+
+  std::vector<std::thread> workers;
 
-    void* Alloc(uint64_t size)
+  for (int i = 0; i < 4; i++)
+  {
+    workers.emplace_back([]()
     {
-      if (_index + size >= MemorySize)
+      ConcurrentAllocator<64 * 1024>::ThreadCache cache(ca);
+
+      for (int j = 0; j < 1000; j++)
       {
-        return nullptr;
+        char* p = (char*)cache.Alloc(j % 100 + 1);
+        FillBuffer(p, j % 100 + 1);
+        cache.Free(p);
       }
+    });
+  }
+
+  for (auto& t : workers)
+  {
+    t.join();
+  }
+
+  //
+  // Scratch arena: no locks, no bookkeeping, bulk reset.
+  //
+  static AtomicArena<64 * 1024> scratch;
 
-      void* addr = &_memory[_index];
-      _blockSizeByAddr[addr] = size;
-      _index += size;
-      return addr;
-    };
+  workers.clear();
 
-    void* ReAlloc(void* ptr, uint64_t size)
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    workers.emplace_back([i]()
     {
-      if (_index + size >= MemorySize)
+      AtomicArena<64 * 1024>::EpochGuard guard(scratch, i);
+
+      for (int j = 0; j < 100; j++)
       {
-        return nullptr;
+        char* p = (char*)scratch.Alloc(j % 32 + 1);
+        FillBuffer(p, j % 32 + 1);
       }
+    });
+  }
 
-      auto oldBlockSize = _blockSizeByAddr[ptr];
+  for (auto& t : workers)
+  {
+    t.join();
+  }
 
-      void* newAddr = &_memory[_index];
-      _blockSizeByAddr[newAddr] = size;
-      _index += size;
+  scratch.Reset();
 
-      std::memcpy(newAddr, ptr, oldBlockSize);
+  if (scratch.Alloc(UINT64_MAX) != nullptr
+   or scratch.Alloc(uint64_t(1) << 63) != nullptr
+   or scratch.Alloc(uint64_t(1) << 63) != nullptr
+   or scratch.Alloc(16) == nullptr
+   or scratch.BytesUsed() > 64)
+  {
+    std::cout << "SCRATCH OVERSIZE ERROR" << std::endl;
+  }
+
+  scratch.Reset();
+
+  //
+  // Standard containers on top of the arena.
+  // Containers initialize their memory themselves,
+  // so arena doesn't need to clear anything.
+  //
+  SmartAllocator<4096> pa("PmrArena", ZeroingPolicy::None);
+  SmartMemoryResource<4096> pmr(pa);
 
-      Free(ptr);
+  {
+    std::pmr::vector<int> v(&pmr);
 
-      return newAddr;
-    };
+    for (int i = 0; i < 100; i++)
+    {
+      v.push_back(i);
+    }
 
-    void Free(void* ptr)
+    for (int i = 0; i < 100; i++)
     {
-      if (_blockSizeByAddr.count(ptr) == 1)
+      if (v[i] != i)
       {
-        auto blockSize = _blockSizeByAddr[ptr];
-        std::memset(ptr, 0, blockSize);
-        _blockSizeByAddr.erase(ptr);
+        std::cout << "PMR ERROR" << std::endl;
       }
-    };
+    }
+  }
+
+  pa.Reset();
+
+  //
+  // Running out of arena is reported the standard way.
+  //
+  SmallAllocator<256> pmrSmall;
+  SmallMemoryResource<256> smallPmr(pmrSmall);
+
+  try
+  {
+    std::pmr::vector<char> v(1000, 0, &smallPmr);
+
+    std::cout << "PMR BAD_ALLOC ERROR" << std::endl;
+  }
+  catch (const std::bad_alloc&)
+  {
+  }
+
+  try
+  {
+    pmr.allocate(SIZE_MAX - 8);
+
+    std::cout << "PMR OVERSIZE ERROR" << std::endl;
+  }
+  catch (const std::bad_alloc&)
+  {
+  }
+
+  //
+  // Big arena that only takes as much memory as it actually uses.
+  //
+  static SmartAllocator<uint64_t(1) << 32, 0, VirtualStorage> va("VirtualArena");
+
+  std::vector<SmartAllocator<uint64_t(1) << 32, 0, VirtualStorage>::Handle> vh;
 
-    void Reset()
+  for (int i = 0; i < 64; i++)
+  {
+    vh.push_back(va.Alloc(1024 * 1024));
+
+    const auto& vi = va.Get(vh.back());
+    if (vi.Addr == nullptr)
     {
-      _blockSizeByAddr.clear();
-      std::memset(&_memory, 0, MemorySize);
-      _index = 0;
+      std::cout << "VIRTUAL ALLOC ERROR" << std::endl;
+      break;
     }
 
-    void Defragment()
+    std::memset(vi.Addr, i, vi.Size);
+  }
+
+  for (size_t i = 0; i < vh.size(); i += 2)
+  {
+    va.Free(vh[i]);
+  }
+
+  //
+  // Blocks are copied on all cores.
+  //
+  WorkerPool pool;
+  va.SetDefragmentWorkers(&pool);
+
+  va.Defragment();
+
+  va.SetDefragmentWorkers(nullptr);
+
+  for (size_t i = 1; i < vh.size(); i += 2)
+  {
+    const auto& vi = va.Get(vh[i]);
+    if (((unsigned char*)vi.Addr)[vi.Size - 1] != i)
     {
-      void* addr = &_memory;
-      uint64_t index = 0;
+      std::cout << "VIRTUAL DEFRAGMENT ERROR" << std::endl;
+    }
+  }
 
-      std::map<void*, uint64_t> newLayout;
+  va.Reset();
 
-      while (not _blockSizeByAddr.empty())
-      {
-        auto it = _blockSizeByAddr.begin();
-        std::memcpy(addr, it->first, it->second);
-        index += it->second;
-        addr = &_memory[index];
-        newLayout[addr] = it->second;
-        _blockSizeByAddr.erase(it);
-      }
+  //
+  // Huge page storage is aligned to 2 MB, commits whole huge pages
+  // and releases them only as a whole. Kernel might refuse huge pages,
+  // then storage works with normal ones.
+  //
+  using HugeStorage = HugePageStorage<64 * 1024 * 1024>;
+
+  HugeStorage hs;
 
-      std::memset(addr, 0, MemorySize - index);
+  const uint64_t hugePage = HugeStorage::HugePageSize;
 
-      _blockSizeByAddr = newLayout;
+  bool hugeOk = hs.Commit(1)
+            and hs.Committed() == hugePage
+            and (uintptr_t)hs.Data() % hugePage == 0;
+
+  if (hugeOk)
+  {
+    std::memset(hs.Data(), 0x5A, hugePage);
+
+    uint64_t kept = hs.Release(1);
+
+    hugeOk = (hs.UsesHugePages() ? kept == hugePage : kept < hugePage)
+         and hs.Data()[0] == 0x5A
+         and hs.Release(0) == 0
+         and IsZero(hs.Data(), hugePage)
+         and hs.Committed() == hugePage;
+  }
+
+  if (not hugeOk)
+  {
+    std::cout << "HUGE PAGE STORAGE ERROR" << std::endl;
+  }
+
+  printf("Huge pages %s\n\n", hs.UsesHugePages() ? "in use" : "not available");
+
+  //
+  // Nothing is cleared with ZeroingPolicy::None, so whatever reads
+  // as zero after Reset() was given back to the OS.
+  //
+  static SmartAllocator<64 * 1024 * 1024, 0, HugePageStorage> ha("HugePageArena",
+                                                                  ZeroingPolicy::None);
+
+  auto hh = ha.Alloc(3 * hugePage);
+  if (hh.IsNull())
+  {
+    std::cout << "HUGE PAGE ALLOC ERROR" << std::endl;
+  }
+  else
+  {
+    std::memset(ha.Get(hh).Addr, 0x5A, 3 * hugePage);
+
+    ha.Reset();
+
+    hh = ha.Alloc(3 * hugePage);
+    if (hh.IsNull() or not IsZero(ha.Get(hh).Addr, 3 * hugePage))
+    {
+      std::cout << "HUGE PAGE RELEASE ERROR" << std::endl;
     }
+  }
 
-  private:
-    static const uint64_t MemorySize = 32;
+  ha.Reset();
 
-    char _memory[MemorySize];
-    uint64_t _index = 0;
-    std::map<void*, uint64_t> _blockSizeByAddr;
-};
+  //
+  // Same-type objects without per-block bookkeeping.
+  //
+  struct Message
+  {
+    uint64_t Id = 0;
+    std::string Text;
 
-// =============================================================================
+    Message(uint64_t id, const std::string& text)
+      : Id(id),
+        Text(text)
+    {
+    }
+  };
 
-void FillBuffer(char* begin, size_t size)
-{
-  for (size_t i = 0; i < size; i++)
+  static ObjectPool<Message, 1000> op;
+
+  std::vector<Message*> msgs;
+
+  for (uint64_t i = 0; i < 1000; i++)
   {
-    begin[i] = (i == size - 1) ? 255 : i;
+    msgs.push_back(op.Acquire(i, std::to_string(i)));
   }
-}
 
-void FillBuffer(char* begin, size_t size, char value)
-{
-  for (size_t i = 0; i < size; i++)
+  if (op.Acquire(0, "") != nullptr)
   {
-    begin[i] = (i == size - 1) ? 255 : value;
+    std::cout << "POOL OVERFLOW ERROR" << std::endl;
   }
-}
 
-// =============================================================================
+  for (size_t i = 0; i < msgs.size(); i += 2)
+  {
+    op.Release(msgs[i]);
+  }
 
-int main()
-{
-  const size_t blockSize = sizeof(int);
+  uint64_t expectedId = 1;
 
-  SmallAllocator a;
+  op.ForEach([&expectedId](Message& m)
+  {
+    if (m.Id != expectedId or m.Text != std::to_string(expectedId))
+    {
+      std::cout << "POOL ERROR" << std::endl;
+    }
 
-  char* p1 = (char*)a.Alloc(blockSize);
-  FillBuffer(p1, blockSize);
-  char* p2 = (char*)a.Alloc(4 * blockSize);
-  FillBuffer(p2, 4 * blockSize);
-  char* p3 = (char*)a.Alloc(2 * blockSize);
-  FillBuffer(p3, 2 * blockSize);
+    expectedId += 2;
+  });
 
-  a.Free(p2);
+  if (op.Size() != 500 or op.Acquire(0, "") != msgs[998])
+  {
+    std::cout << "POOL REUSE ERROR" << std::endl;
+  }
+
+  op.Clear();
 
   //
-  // FIXME: all raw pointers to previously allocated memory
-  // are now invalid!
+  // Objects that are not trivially copyable survive compaction,
+  // since they are moved by their own move constructor.
   //
-  a.Defragment();
+  SmartAllocator<4096> oa("ObjectArena");
 
-  SmartAllocator<64> sa("SmartAlloc1");
+  auto os1 = oa.New<std::string>("first");
+  auto os2 = oa.New<std::string>("second");
+  auto os3 = oa.New<std::string>("third");
 
-  const auto& sp1 = sa.Alloc(blockSize);
-  FillBuffer((char*)sp1.Addr, sp1.Size);
-  const auto& sp2 = sa.Alloc(4 * blockSize);
-  FillBuffer((char*)sp2.Addr, sp2.Size);
-  const auto& sp3 = sa.Alloc(2 * blockSize);
-  FillBuffer((char*)sp3.Addr, sp3.Size);
+  oa.Free(os1);
+  oa.Defragment();
 
-  sa.Free(sp2);
+  if (*oa.GetObject<std::string>(os2) != "second"
+   or *oa.GetObject<std::string>(os3) != "third")
+  {
+    std::cout << "RELOCATION ERROR" << std::endl;
+  }
 
-  sa.Defragment();
+  oa.Reset();
 
   //
-  // sp2 is invalid, but this won't crash the program
-  // since now it just contains a placeholder value
-  // of 0 size buffer, so for loop won't even start.
+  // Objects still alive are destroyed along with the allocator.
   //
-  // In reality one should check BlockInfo::Addr against nullptr.
+  struct Counted
+  {
+    int* Counter = nullptr;
+
+    Counted(int* counter)
+      : Counter(counter)
+    {
+    }
+
+    Counted(Counted&& other)
+      : Counter(other.Counter)
+    {
+      other.Counter = nullptr;
+    }
+
+    ~Counted()
+    {
+      if (Counter != nullptr)
+      {
+        (*Counter)++;
+      }
+    }
+  };
+
+  int destroyed = 0;
+
+  {
+    SmartAllocator<4096> ca;
+
+    ca.New<Counted>(&destroyed);
+    ca.New<Counted>(&destroyed);
+  }
+
+  if (destroyed != 2)
+  {
+    std::cout << "DESTRUCTOR ERROR" << std::endl;
+  }
+
   //
-  FillBuffer((char*)sp2.Addr, sp2.Size, 32);
+  // Pinned buffer keeps its address through compaction,
+  // other blocks are moved around it.
+  //
+  SmartAllocator<4096> ia("IoArena");
+
+  auto ib1 = ia.Alloc(256);
+  auto ib2 = ia.Alloc(512);
+  auto ib3 = ia.Alloc(128);
+
+  ia.Pin(ib2);
+
+  void* ioBuffer = ia.Get(ib2).Addr;
+
+  ia.Free(ib1);
+  ia.Defragment();
+
+  if (ia.Get(ib2).Addr != ioBuffer or ia.Get(ib3).Addr >= ioBuffer)
+  {
+    std::cout << "PIN ERROR" << std::endl;
+  }
+
+  ia.Unpin(ib2);
+
+  auto stats = ia.GetStats();
+
+  printf("'%s': %llu bytes live, peak %llu, fragmentation %.2f\n\n",
+         stats.Tag,
+         (unsigned long long)stats.BytesLive,
+         (unsigned long long)stats.PeakBytesLive,
+         stats.Fragmentation());
+
+  //
+  // Per-tick scratch memory released at scope exit.
+  //
+  static DoubleBufferedFrameAllocator<16 * 1024> fa;
+
+  int* lastTick = nullptr;
+
+  for (int tick = 0; tick < 4; tick++)
+  {
+    fa.SwapFrames();
+
+    if (lastTick != nullptr and *lastTick != tick - 1)
+    {
+      std::cout << "FRAME ERROR" << std::endl;
+    }
+
+    lastTick  = (int*)fa.Alloc(sizeof(int));
+    *lastTick = tick;
+
+    auto& frame = fa.CurrentFrame();
+    auto used   = frame.BytesUsed();
+
+    {
+      decltype(fa)::Frame::Scope scope(frame);
+
+      char* p = (char*)frame.Alloc(1024);
+      FillBuffer(p, 1024);
+    }
+
+    if (frame.BytesUsed() != used)
+    {
+      std::cout << "FRAME SCOPE ERROR" << std::endl;
+    }
+
+    if (fa.Alloc(UINT64_MAX) != nullptr or frame.BytesUsed() != used)
+    {
+      std::cout << "FRAME OVERSIZE ERROR" << std::endl;
+    }
+  }
 
   //
-  // Now works!
+  // Blocks read as zero when handed out, also when they grow back
+  // over bytes they held before, or are reused after Free().
   //
-  FillBuffer((char*)sp3.Addr, sp3.Size, 64);
+  SmallAllocator<256> za(ZeroingPolicy::OnAlloc);
+
+  char* zp = (char*)za.Alloc(16);
+  std::memset(zp, 0x5A, 16);
+  zp = (char*)za.ReAlloc(zp, 2);
+  zp = (char*)za.ReAlloc(zp, 3);
+
+  char* zq = (char*)za.Alloc(16);
+  std::memset(zq, 0x5A, 16);
+  zq = (char*)za.ReAlloc(zq, 6);
+  zq = (char*)za.ReAlloc(zq, 16);
+
+  SmallAllocator<256> zn(ZeroingPolicy::None);
+
+  char* zr = (char*)zn.Alloc(24);
+  std::memset(zr, 0x5A, 24);
+  zn.Free(zr);
+  zr = (char*)zn.AllocZeroed(24);
+
+  if (zp[0] != 0x5A or not IsZero(zp + 2, 1)
+   or zq[5] != 0x5A or not IsZero(zq + 6, 10)
+   or not IsZero(zr, 24))
+  {
+    std::cout << "SMALL ZEROING ERROR" << std::endl;
+  }
+
+  SmartAllocator<256> zsa("ZeroOnAlloc", ZeroingPolicy::OnAlloc);
+
+  auto zh1 = zsa.Alloc(16);
+  std::memset(zsa.Get(zh1).Addr, 0x5A, 16);
+  zh1 = zsa.ReAlloc(zh1, 2);
+  zh1 = zsa.ReAlloc(zh1, 16);
+
+  auto zh2 = zsa.Alloc(32);
+  std::memset(zsa.Get(zh2).Addr, 0x5A, 32);
+  zsa.Free(zh2);
+  zh2 = zsa.Alloc(32);
+
+  SmartAllocator<256> zsn("ZeroNone", ZeroingPolicy::None);
+
+  auto zh3 = zsn.Alloc(32);
+  std::memset(zsn.Get(zh3).Addr, 0x5A, 32);
+  zsn.Free(zh3);
+  zh3 = zsn.AllocZeroed(32);
+
+  if (((char*)zsa.Get(zh1).Addr)[1] != 0x5A
+   or not IsZero((char*)zsa.Get(zh1).Addr + 2, 14)
+   or not IsZero(zsa.Get(zh2).Addr, 32)
+   or not IsZero(zsn.Get(zh3).Addr, 32))
+  {
+    std::cout << "SMART ZEROING ERROR" << std::endl;
+  }
 
   //
-  // Still, after realloc old reference (sp3) will be invalidated.
+  // Tiny objects with one bit of bookkeeping per 16 bytes.
   //
-  const auto& sp4 = sa.ReAlloc(sp3, 3 * blockSize);
-  FillBuffer((char*)sp4.Addr, sp4.Size);
+  static BitmapAllocator<64 * 1024> bma;
 
-  const auto& sp5 = sa.Alloc(3 * blockSize);
-  FillBuffer((char*)sp5.Addr, sp5.Size);
+  std::vector<char*> tiny;
 
-  sa.Free(sp4);
+  for (int i = 0; i < 1000; i++)
+  {
+    char* p = (char*)bma.Alloc(1 + i % 40);
+    if (p == nullptr)
+    {
+      std::cout << "BITMAP ALLOC ERROR" << std::endl;
+      break;
+    }
 
-  sa.Defragment();
+    FillBuffer(p, 1 + i % 40, i);
+    tiny.push_back(p);
+  }
+
+  for (size_t i = 0; i < tiny.size(); i += 3)
+  {
+    bma.Free(tiny[i], 1 + i % 40);
+  }
+
+  for (size_t i = 1; i < tiny.size(); i += 3)
+  {
+    if (tiny[i][0] != (char)((i % 40 == 0) ? 255 : i))
+    {
+      std::cout << "BITMAP DATA ERROR" << std::endl;
+    }
+  }
+
+  if (bma.Alloc(UINT64_MAX) != nullptr or bma.Alloc(64 * 1024 + 1) != nullptr)
+  {
+    std::cout << "BITMAP OVERSIZE ERROR" << std::endl;
+  }
+
+  auto census = bma.GetStats();
+
+  printf("Bitmap arena: %llu bytes used, %llu free extents, fragmentation %.2f\n\n",
+         (unsigned long long)census.BytesUsed,
+         (unsigned long long)census.FreeExtents,
+         census.Fragmentation());
 
   /*
   SmallAllocator A1;
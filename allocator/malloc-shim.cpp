@@ -0,0 +1,335 @@
+#include "concurrent-allocator.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <new>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+//
+// malloc() family on top of ConcurrentAllocator, to be loaded
+// into unmodified programs with LD_PRELOAD:
+//
+// LD_PRELOAD=./liballocator_shim.so ./server
+//
+// Arena is reserved up front and pages are committed by the kernel
+// as they are touched. Every thread gets its own ThreadCache,
+// which is flushed back to the central arena when thread exits.
+//
+// Nothing here may call malloc() itself, so allocator is constructed
+// lazily in static storage, thread caches are allocated from the arena,
+// and thread exit is caught with pthread key destructor instead
+// of thread_local object with destructor.
+//
+
+namespace
+{
+  const uint64_t ArenaSize = uint64_t(16) * 1024 * 1024 * 1024;
+
+  using Allocator = ConcurrentAllocator<ArenaSize, VirtualStorage>;
+  using Cache     = Allocator::ThreadCache;
+
+  enum class State
+  {
+    Uninitialized = 0,
+    Initializing,
+    Ready
+  };
+
+  std::atomic<State> AllocatorState{State::Uninitialized};
+
+  alignas(Allocator) char AllocatorStorage[sizeof(Allocator)];
+
+  pthread_key_t CacheKey;
+
+  __thread Cache* ThreadCachePtr __attribute__((tls_model("initial-exec"))) = nullptr;
+
+  Allocator& GetAllocator()
+  {
+    Allocator* allocator = (Allocator*)AllocatorStorage;
+
+    if (AllocatorState.load(std::memory_order_acquire) == State::Ready)
+    {
+      return *allocator;
+    }
+
+    State expected = State::Uninitialized;
+    if (AllocatorState.compare_exchange_strong(expected, State::Initializing))
+    {
+      new (allocator) Allocator();
+
+      pthread_key_create(&CacheKey, [](void* cache)
+      {
+        Allocator* allocator = (Allocator*)AllocatorStorage;
+
+        ThreadCachePtr = nullptr;
+
+        ((Cache*)cache)->~Cache();
+        allocator->Free(cache);
+      });
+
+      AllocatorState.store(State::Ready, std::memory_order_release);
+    }
+    else
+    {
+      while (AllocatorState.load(std::memory_order_acquire) != State::Ready)
+      {
+        sched_yield();
+      }
+    }
+
+    return *allocator;
+  }
+
+  //
+  // Returns nullptr if there's no room for the cache in the arena,
+  // callers then go to the central arena directly. Cache of an exiting
+  // thread is dropped by the key destructor, which clears ThreadCachePtr.
+  //
+  Cache* GetCache()
+  {
+    if (ThreadCachePtr != nullptr)
+    {
+      return ThreadCachePtr;
+    }
+
+    Allocator& allocator = GetAllocator();
+
+    void* memory = allocator.Alloc(sizeof(Cache));
+    if (memory == nullptr)
+    {
+      return nullptr;
+    }
+
+    Cache* cache = new (memory) Cache(allocator);
+
+    ThreadCachePtr = cache;
+
+    pthread_setspecific(CacheKey, cache);
+
+    return cache;
+  }
+
+  void* Allocate(size_t size)
+  {
+    //
+    // Huge sizes would otherwise wrap around
+    // once block overhead is added.
+    //
+    if (size > ArenaSize)
+    {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    Cache* cache = GetCache();
+
+    void* ptr = (cache != nullptr)
+              ? cache->Alloc(size)
+              : GetAllocator().Alloc(size);
+
+    if (ptr == nullptr)
+    {
+      errno = ENOMEM;
+    }
+
+    return ptr;
+  }
+
+  void* AllocateAligned(size_t size, size_t alignment)
+  {
+    if (alignment <= Allocator::MinAlignment)
+    {
+      return Allocate(size);
+    }
+
+    if (size > ArenaSize or alignment > ArenaSize)
+    {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    void* ptr = GetAllocator().AllocAligned(size, alignment);
+    if (ptr == nullptr)
+    {
+      errno = ENOMEM;
+    }
+
+    return ptr;
+  }
+
+  bool IsPowerOfTwo(size_t value)
+  {
+    return (value != 0 and (value & (value - 1)) == 0);
+  }
+}
+
+// =============================================================================
+
+extern "C"
+{
+  void* malloc(size_t size)
+  {
+    return Allocate(size);
+  }
+
+  void free(void* ptr)
+  {
+    if (ptr == nullptr)
+    {
+      return;
+    }
+
+    Allocator& allocator = GetAllocator();
+
+    //
+    // Blocks that were handed out before the shim took over
+    // are not ours to free.
+    //
+    if (not allocator.Owns(ptr))
+    {
+      return;
+    }
+
+    Cache* cache = ThreadCachePtr;
+
+    if (cache != nullptr)
+    {
+      cache->Free(ptr);
+    }
+    else
+    {
+      allocator.Free(ptr);
+    }
+  }
+
+  void* calloc(size_t count, size_t size)
+  {
+    size_t total = 0;
+    if (__builtin_mul_overflow(count, size, &total))
+    {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    //
+    // Cached blocks are not cleared when freed.
+    //
+    void* ptr = Allocate(total);
+    if (ptr != nullptr)
+    {
+      std::memset(ptr, 0, total);
+    }
+
+    return ptr;
+  }
+
+  void* realloc(void* ptr, size_t size)
+  {
+    if (ptr == nullptr)
+    {
+      return Allocate(size);
+    }
+
+    if (size == 0)
+    {
+      free(ptr);
+      return nullptr;
+    }
+
+    if (not GetAllocator().Owns(ptr))
+    {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    uint64_t usable = Allocator::UsableSize(ptr);
+    if (size <= usable)
+    {
+      return ptr;
+    }
+
+    void* newPtr = Allocate(size);
+    if (newPtr == nullptr)
+    {
+      return nullptr;
+    }
+
+    std::memcpy(newPtr, ptr, usable);
+
+    free(ptr);
+
+    return newPtr;
+  }
+
+  int posix_memalign(void** result, size_t alignment, size_t size)
+  {
+    if (not IsPowerOfTwo(alignment) or alignment % sizeof(void*) != 0)
+    {
+      return EINVAL;
+    }
+
+    void* ptr = AllocateAligned(size, alignment);
+    if (ptr == nullptr)
+    {
+      return ENOMEM;
+    }
+
+    *result = ptr;
+
+    return 0;
+  }
+
+  //
+  // Aligned versions all have to be replaced, otherwise their
+  // blocks would come from glibc and end up in our free().
+  //
+  void* aligned_alloc(size_t alignment, size_t size)
+  {
+    if (not IsPowerOfTwo(alignment))
+    {
+      errno = EINVAL;
+      return nullptr;
+    }
+
+    return AllocateAligned(size, alignment);
+  }
+
+  void* memalign(size_t alignment, size_t size)
+  {
+    return aligned_alloc(alignment, size);
+  }
+
+  void* valloc(size_t size)
+  {
+    return AllocateAligned(size, sysconf(_SC_PAGESIZE));
+  }
+
+  void* pvalloc(size_t size)
+  {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    size_t rounded = 0;
+    if (__builtin_add_overflow(size, pageSize - 1, &rounded))
+    {
+      errno = ENOMEM;
+      return nullptr;
+    }
+
+    return AllocateAligned(rounded / pageSize * pageSize, pageSize);
+  }
+
+  size_t malloc_usable_size(void* ptr)
+  {
+    if (ptr == nullptr or not GetAllocator().Owns(ptr))
+    {
+      return 0;
+    }
+
+    return Allocator::UsableSize(ptr);
+  }
+}
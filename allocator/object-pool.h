@@ -0,0 +1,240 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include "arena-storage.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <new>
+#include <utility>
+
+//
+// Pool of up to N objects of the same type.
+//
+// Objects are packed one after another in a single arena, which
+// grows by slabs of SlabSize objects. Released cells are chained
+// into intrusive free list and reused first, so Acquire() and Release()
+// are O(1) and never touch the heap. Live cells are marked in a bitmap,
+// one word per slab, so ForEach() walks objects in address order
+// and skips empty slabs at once.
+//
+template <typename T,
+          uint64_t N,
+          template <uint64_t> class Storage = InlineStorage>
+class ObjectPool
+{
+  public:
+    static const uint64_t SlabSize = 64;
+
+    ObjectPool() = default;
+
+    ~ObjectPool()
+    {
+      Clear();
+    }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    //
+    // Constructs object in place, returns nullptr when pool is full.
+    //
+    template <typename... Args>
+    T* Acquire(Args&&... args)
+    {
+      uint64_t index = PopFreeCell();
+      if (index == NoCell)
+      {
+        return nullptr;
+      }
+
+      Cell* cell = CellAt(index);
+
+      try
+      {
+        new (&cell->Object) T(std::forward<Args>(args)...);
+      }
+      catch (...)
+      {
+        PushFreeCell(index);
+        throw;
+      }
+
+      _live[index / SlabSize] |= Bit(index);
+      _size++;
+
+      return &cell->Object;
+    }
+
+    //
+    // Destroys object and returns its cell to the pool.
+    // Pointers that don't belong to the pool are ignored.
+    //
+    void Release(T* object)
+    {
+      uint64_t index = IndexOf(object);
+      if (index == NoCell)
+      {
+        return;
+      }
+
+      object->~T();
+
+      _live[index / SlabSize] &= ~Bit(index);
+      _size--;
+
+      PushFreeCell(index);
+    }
+
+    //
+    // Calls f(T&) for every live object in address order.
+    //
+    template <typename F>
+    void ForEach(F f)
+    {
+      uint64_t slabs = (_used + SlabSize - 1) / SlabSize;
+
+      for (uint64_t slab = 0; slab < slabs; slab++)
+      {
+        uint64_t word = _live[slab];
+
+        while (word != 0)
+        {
+          uint64_t index = slab * SlabSize + __builtin_ctzll(word);
+          word &= word - 1;
+
+          f(CellAt(index)->Object);
+        }
+      }
+    }
+
+    //
+    // Destroys all live objects, memory is kept for reuse.
+    //
+    void Clear()
+    {
+      ForEach([](T& object) { object.~T(); });
+
+      for (auto& word : _live)
+      {
+        word = 0;
+      }
+
+      _used     = 0;
+      _size     = 0;
+      _freeCell = NoCell;
+    }
+
+    uint64_t Size() const
+    {
+      return _size;
+    }
+
+    static constexpr uint64_t Capacity()
+    {
+      return N;
+    }
+
+  private:
+    static const uint64_t NoCell = UINT64_MAX;
+
+    //
+    // Free cell holds index of the next free one
+    // in place of the object.
+    //
+    union Cell
+    {
+      Cell()  {}
+      ~Cell() {}
+
+      T Object;
+      uint64_t NextFree;
+    };
+
+    static const uint64_t Slabs = (N + SlabSize - 1) / SlabSize;
+
+    static_assert(N > 0, "Pool can't be empty");
+    static_assert(alignof(Cell) <= 64, "Storage is only 64 byte aligned");
+
+    static uint64_t Bit(uint64_t index)
+    {
+      return uint64_t(1) << (index % SlabSize);
+    }
+
+    Cell* CellAt(uint64_t index)
+    {
+      return (Cell*)_storage.Data() + index;
+    }
+
+    uint64_t IndexOf(T* object)
+    {
+      char* base = _storage.Data();
+      char* p    = (char*)object;
+
+      if (p < base or p >= base + _used * sizeof(Cell))
+      {
+        return NoCell;
+      }
+
+      uint64_t offset = p - base;
+      uint64_t index  = offset / sizeof(Cell);
+
+      if (offset % sizeof(Cell) != 0
+       or (_live[index / SlabSize] & Bit(index)) == 0)
+      {
+        return NoCell;
+      }
+
+      return index;
+    }
+
+    //
+    // Reuses released cells first, then takes next cell
+    // from the current slab, committing new slab if needed.
+    //
+    uint64_t PopFreeCell()
+    {
+      if (_freeCell != NoCell)
+      {
+        uint64_t index = _freeCell;
+        _freeCell = CellAt(index)->NextFree;
+        return index;
+      }
+
+      if (_used == N)
+      {
+        return NoCell;
+      }
+
+      if (_used % SlabSize == 0)
+      {
+        uint64_t slabEnd = std::min(_used + SlabSize, N);
+        if (not _storage.Commit(slabEnd * sizeof(Cell)))
+        {
+          return NoCell;
+        }
+      }
+
+      return _used++;
+    }
+
+    void PushFreeCell(uint64_t index)
+    {
+      CellAt(index)->NextFree = _freeCell;
+      _freeCell = index;
+    }
+
+    Storage<N * sizeof(Cell)> _storage;
+
+    uint64_t _live[Slabs] = {};
+
+    //
+    // Cells after this one were never handed out.
+    //
+    uint64_t _used = 0;
+    uint64_t _size = 0;
+
+    uint64_t _freeCell = NoCell;
+};
+
+#endif // include guard
@@ -0,0 +1,120 @@
+#ifndef PMR_RESOURCE_H
+#define PMR_RESOURCE_H
+
+#include "smart-allocator.h"
+#include "small-allocator.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+
+//
+// std::pmr::memory_resource on top of SmartAllocator,
+// so that pmr containers can live in the arena
+// and be released all at once with SmartAllocator::Reset().
+//
+// Block handle is stored right before the returned pointer.
+// Containers hold raw pointers, so Defragment() must not be called
+// on the underlying allocator while they are alive.
+//
+template <uint64_t MemorySize,
+          uint64_t MaxBlocks = 0,
+          template <uint64_t> class Storage = InlineStorage>
+class SmartMemoryResource : public std::pmr::memory_resource
+{
+  public:
+    using Allocator = SmartAllocator<MemorySize, MaxBlocks, Storage>;
+    using Handle    = typename Allocator::Handle;
+
+    SmartMemoryResource(Allocator& allocator)
+      : _allocator(allocator)
+    {
+    }
+
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      //
+      // Keeps returned pointer aligned, since block itself is.
+      //
+      size_t prefix = (sizeof(Handle) + alignment - 1)
+                    / alignment
+                    * alignment;
+
+      if (bytes > MemorySize or prefix > MemorySize - bytes)
+      {
+        throw std::bad_alloc();
+      }
+
+      Handle h = _allocator.Alloc(prefix + bytes, alignment);
+      if (h.IsNull())
+      {
+        throw std::bad_alloc();
+      }
+
+      char* p = (char*)_allocator.Get(h).Addr + prefix;
+
+      std::memcpy(p - sizeof(Handle), &h, sizeof(Handle));
+
+      return p;
+    }
+
+    void do_deallocate(void* p, size_t, size_t) override
+    {
+      Handle h;
+      std::memcpy(&h, (char*)p - sizeof(Handle), sizeof(Handle));
+
+      _allocator.Free(h);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return (this == &other);
+    }
+
+    Allocator& _allocator;
+};
+
+// =============================================================================
+
+//
+// std::pmr::memory_resource on top of SmallAllocator.
+//
+template <uint64_t MemorySize = 32>
+class SmallMemoryResource : public std::pmr::memory_resource
+{
+  public:
+    using Allocator = SmallAllocator<MemorySize>;
+
+    SmallMemoryResource(Allocator& allocator)
+      : _allocator(allocator)
+    {
+    }
+
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      void* p = _allocator.Alloc(bytes, alignment);
+      if (p == nullptr)
+      {
+        throw std::bad_alloc();
+      }
+
+      return p;
+    }
+
+    void do_deallocate(void* p, size_t, size_t) override
+    {
+      _allocator.Free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return (this == &other);
+    }
+
+    Allocator& _allocator;
+};
+
+#endif // include guard
@@ -0,0 +1,263 @@
+#include "alloc-trace.h"
+#include "bench-backends.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// Replays allocation trace recorded with TraceRecorder
+// against every backend and reports throughput,
+// peak footprint and time spent in Defragment().
+//
+// Trace is read into memory first, so file I/O is not measured.
+// Recorded alignment is not replayed, all backends
+// hand out Alignment aligned blocks.
+//
+
+struct ReplayResult
+{
+  uint64_t Ops    = 0;
+  uint64_t Failed = 0;
+
+  uint64_t PeakFootprint = 0;
+  uint64_t PeakLiveBytes = 0;
+
+  std::chrono::nanoseconds Elapsed{0};
+  std::chrono::nanoseconds DefragmentTime{0};
+
+  //
+  // Not part of Elapsed, querying footprint costs
+  // differently on every backend.
+  //
+  std::chrono::nanoseconds SampleTime{0};
+};
+
+//
+// Recorded traces can be much bigger than bench patterns.
+// Arena is only reserved, so this costs address space only.
+//
+using ReplaySmartBackend = BasicSmartBackend<uint64_t(8) << 30>;
+
+//
+// Footprint can be expensive to query, so it's sampled.
+//
+const uint64_t FootprintSamplePeriod = 1024;
+
+template <typename B>
+ReplayResult Replay(B* backend, const std::vector<TraceRecord>& trace)
+{
+  ReplayResult res;
+
+  struct Block
+  {
+    typename B::Ref Ref;
+    uint64_t Size = 0;
+  };
+
+  std::unordered_map<uint64_t, Block> blocks;
+
+  uint64_t liveBytes = 0;
+
+  //
+  // Malloc heap already holds the trace and other backends.
+  //
+  uint64_t baseFootprint = backend->Footprint();
+
+  auto freeAll = [&]()
+  {
+    for (auto& kv : blocks)
+    {
+      backend->Free(kv.second.Ref);
+    }
+
+    blocks.clear();
+    liveBytes = 0;
+  };
+
+  auto started = std::chrono::steady_clock::now();
+
+  for (const TraceRecord& r : trace)
+  {
+    res.Ops++;
+
+    switch (r.Op)
+    {
+      case TraceOp::Alloc:
+      {
+        Block block;
+        block.Ref  = backend->Alloc(r.Size);
+        block.Size = r.Size;
+
+        if (backend->IsNull(block.Ref))
+        {
+          res.Failed++;
+          break;
+        }
+
+        blocks[r.Id] = block;
+        liveBytes += r.Size;
+      }
+      break;
+
+      case TraceOp::ReAlloc:
+      {
+        auto it = blocks.find(r.Id);
+        if (it == blocks.end())
+        {
+          res.Failed++;
+          break;
+        }
+
+        auto ref = backend->ReAlloc(it->second.Ref, r.Size);
+        if (backend->IsNull(ref))
+        {
+          res.Failed++;
+          break;
+        }
+
+        liveBytes += r.Size - it->second.Size;
+
+        it->second.Ref  = ref;
+        it->second.Size = r.Size;
+      }
+      break;
+
+      case TraceOp::Free:
+      {
+        auto it = blocks.find(r.Id);
+        if (it == blocks.end())
+        {
+          res.Failed++;
+          break;
+        }
+
+        backend->Free(it->second.Ref);
+
+        liveBytes -= it->second.Size;
+        blocks.erase(it);
+      }
+      break;
+
+      case TraceOp::Reset:
+        freeAll();
+        break;
+
+      case TraceOp::Defragment:
+      case TraceOp::DefragmentStep:
+      case TraceOp::DefragmentStepTime:
+      {
+        auto defragStarted = std::chrono::steady_clock::now();
+
+        if (r.Op == TraceOp::Defragment)
+        {
+          backend->Defragment();
+        }
+        else if (r.Op == TraceOp::DefragmentStep)
+        {
+          backend->DefragmentStep(r.Size);
+        }
+        else
+        {
+          backend->DefragmentStep(std::chrono::nanoseconds(r.Size));
+        }
+
+        res.DefragmentTime += std::chrono::steady_clock::now() - defragStarted;
+      }
+      break;
+
+      default:
+        res.Failed++;
+        break;
+    }
+
+    if (liveBytes > res.PeakLiveBytes or res.Ops % FootprintSamplePeriod == 0)
+    {
+      auto sampleStarted = std::chrono::steady_clock::now();
+
+      res.PeakLiveBytes = std::max(res.PeakLiveBytes, liveBytes);
+      uint64_t footprint = backend->Footprint();
+
+      if (footprint > baseFootprint)
+      {
+        res.PeakFootprint = std::max(res.PeakFootprint, footprint - baseFootprint);
+      }
+
+      res.SampleTime += std::chrono::steady_clock::now() - sampleStarted;
+    }
+  }
+
+  freeAll();
+
+  res.Elapsed = std::chrono::steady_clock::now() - started - res.SampleTime;
+
+  return res;
+}
+
+template <typename B>
+void PrintReplay(B* backend, const std::vector<TraceRecord>& trace)
+{
+  ReplayResult res = Replay(backend, trace);
+
+  double seconds = std::chrono::duration<double>(res.Elapsed).count();
+  double opsPerSec = (seconds == 0.0) ? 0.0 : res.Ops / seconds;
+
+  printf("%-15s %14.0f %10llu %14llu %14llu %12.3f\n",
+         B::Name,
+         opsPerSec,
+         (unsigned long long)res.Failed,
+         (unsigned long long)res.PeakLiveBytes,
+         (unsigned long long)res.PeakFootprint,
+         std::chrono::duration<double, std::milli>(res.DefragmentTime).count());
+}
+
+// =============================================================================
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    printf("Usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(argv[1]);
+  if (not reader.IsOpen())
+  {
+    return 1;
+  }
+
+  std::vector<TraceRecord> trace;
+
+  TraceRecord r;
+  while (reader.Next(r))
+  {
+    trace.push_back(r);
+  }
+
+  //
+  // Created up front, so that whatever they print
+  // doesn't end up in the middle of the report.
+  //
+  auto mallocBackend = std::make_unique<MallocBackend>();
+  auto smartBackend  = std::make_unique<ReplaySmartBackend>();
+  auto smallBackend  = std::make_unique<SmallBackend>();
+
+  printf("%llu records\n\n", (unsigned long long)trace.size());
+
+  printf("%-15s %14s %10s %14s %14s %12s\n",
+         "allocator", "ops/s", "failed", "peak live", "peak footprint",
+         "defrag ms");
+
+  PrintReplay(mallocBackend.get(), trace);
+  PrintReplay(smartBackend.get(), trace);
+  PrintReplay(smallBackend.get(), trace);
+
+  return 0;
+}
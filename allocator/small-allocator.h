@@ -0,0 +1,585 @@
+#ifndef SMALL_ALLOCATOR_H
+#define SMALL_ALLOCATOR_H
+
+#include "zeroing-policy.h"
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+//
+// Side tables cost 17 bytes per 4 byte granule,
+// so this is meant for small arenas only.
+//
+template <uint64_t MemorySize = 32>
+class SmallAllocator
+{
+  public:
+    SmallAllocator(ZeroingPolicy zeroing = ZeroingPolicy::Eager)
+      : _zeroing(zeroing)
+    {
+      //
+      // Arena is not clean yet.
+      //
+      _dirtyIndex = MemorySize;
+
+      Reset();
+
+      /*
+      printf("Memory range: [0x%X - 0x%X]\n\n",
+             &_memory[0], &_memory[MemorySize - 1]);
+      */
+    }
+
+    //
+    // Alignment must be power of two.
+    //
+    void* Alloc(uint64_t size, uint64_t alignment = 1)
+    {
+      void* ptr = AllocBlock(size, alignment);
+
+      //
+      // Whole granules are cleared, since in-place ReAlloc()
+      // can later grow block up to its rounded size for free.
+      //
+      if (ptr != nullptr and _zeroing == ZeroingPolicy::OnAlloc)
+      {
+        std::memset(ptr, 0, RoundToSizeClass(size));
+      }
+
+      return ptr;
+    };
+
+    //
+    // Like calloc(): block is zeroed regardless of zeroing policy,
+    // but memory that is known to be clean is not touched again.
+    //
+    void* AllocZeroed(uint64_t size, uint64_t alignment = 1)
+    {
+      void* ptr = Alloc(size, alignment);
+
+      if (ptr != nullptr and _zeroing == ZeroingPolicy::None)
+      {
+        std::memset(ptr, 0, size);
+      }
+
+      return ptr;
+    }
+
+    //
+    // Block is resized in place if it shrinks or if it's followed
+    // by enough free space, otherwise it's moved.
+    // Zero alignment keeps the one block was allocated with.
+    //
+    void* ReAlloc(void* ptr, uint64_t size, uint64_t alignment = 0)
+    {
+      uint64_t granule = GranuleOf(ptr);
+      if (granule == NoGranule or _blockGranules[granule] == 0)
+      {
+        return nullptr;
+      }
+
+      uint64_t oldBlockSize = BlockSizeAt(granule);
+
+      if (alignment == 0)
+      {
+        alignment = BlockAlignmentAt(granule);
+      }
+
+      if (ResizeInPlace(granule, size, alignment))
+      {
+        return ptr;
+      }
+
+      void* newAddr = Alloc(size, alignment);
+      if (newAddr == nullptr)
+      {
+        return nullptr;
+      }
+
+      std::memcpy(newAddr, ptr, std::min(oldBlockSize, size));
+
+      Free(ptr);
+
+      return newAddr;
+    };
+
+    void Free(void* ptr)
+    {
+      uint64_t granule = GranuleOf(ptr);
+      if (granule == NoGranule or _blockGranules[granule] == 0)
+      {
+        return;
+      }
+
+      uint64_t blockGranules = _blockGranules[granule];
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        std::memset(ptr, 0, blockGranules * SizeClassGranularity);
+      }
+
+      _blockGranules[granule] = 0;
+
+      PushFreeBlock(granule, blockGranules);
+    };
+
+    void Reset()
+    {
+      std::memset(_blockGranules, 0, sizeof(_blockGranules));
+      ClearFreeLists();
+
+      _index = 0;
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        ClearTail();
+      }
+    }
+
+    void Defragment()
+    {
+      uint64_t index = 0;
+
+      //
+      // All free space ends up at the tail and in alignment gaps,
+      // so free lists are rebuilt from scratch.
+      //
+      ClearFreeLists();
+
+      //
+      // Blocks only ever move towards the beginning,
+      // so side tables can be rewritten in place.
+      //
+      for (uint64_t granule = 0;
+           granule < _index / SizeClassGranularity;
+           granule++)
+      {
+        if (_blockGranules[granule] == 0)
+        {
+          continue;
+        }
+
+        uint64_t blockSize = BlockSizeAt(granule);
+        uint64_t alignment = BlockAlignmentAt(granule);
+
+        uint64_t offset = AlignedOffset(index, alignment);
+
+        //
+        // Alignment gap might hold leftovers of moved blocks.
+        //
+        if (_zeroing == ZeroingPolicy::Eager)
+        {
+          std::memset(&_memory[index], 0, offset - index);
+        }
+
+        PushFreeRange(index, offset);
+
+        std::memmove(&_memory[offset],
+                     &_memory[granule * SizeClassGranularity],
+                     blockSize);
+
+        _blockGranules[granule] = 0;
+
+        PlaceBlock(offset, blockSize, alignment);
+
+        index = offset + blockSize;
+      }
+
+      _index = index;
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        ClearTail();
+      }
+    }
+
+    //
+    // Bytes up to the end of the last block, free holes included.
+    //
+    uint64_t BytesUsed() const
+    {
+      return _index;
+    }
+
+  private:
+    //
+    // Block sizes are kept in a side table indexed by block offset
+    // in granules, so no per-block heap nodes are needed.
+    //
+    // Freed blocks are kept in per-size-class intrusive lists,
+    // where class N holds blocks of N * SizeClassGranularity bytes.
+    //
+    // Sizes and links are counted in granules, so 32 bits
+    // are enough for them.
+    //
+    static const uint64_t SizeClassGranularity = 4;
+    static const uint64_t Granules    = MemorySize / SizeClassGranularity;
+    static const uint64_t SizeClasses = Granules;
+    static const uint32_t NoGranule   = UINT32_MAX;
+
+    static_assert(MemorySize % SizeClassGranularity == 0,
+                  "Arena must consist of whole granules");
+
+    static_assert(Granules < NoGranule,
+                  "Arena is too big for 32 bit granule indices");
+
+    void* AllocBlock(uint64_t size, uint64_t alignment)
+    {
+      if (alignment == 0 or (alignment & (alignment - 1)) != 0)
+      {
+        return nullptr;
+      }
+
+      //
+      // Block can't be bigger than the arena, and size class
+      // of anything that fits has its own free list.
+      //
+      if (size >= MemorySize)
+      {
+        return nullptr;
+      }
+
+      size = RoundToSizeClass(size);
+
+      //
+      // Reuse previously freed block of the same size class first.
+      //
+      uint64_t cls  = size / SizeClassGranularity;
+      uint64_t head = _freeListHead[cls];
+      if (head != NoGranule
+       and AlignedOffset(head * SizeClassGranularity, alignment)
+        == head * SizeClassGranularity)
+      {
+        PopFreeBlock(cls);
+        return PlaceBlock(head * SizeClassGranularity, size, alignment);
+      }
+
+      uint64_t offset = AlignedOffset(_index, alignment);
+      if (offset + size >= MemorySize)
+      {
+        return AllocFromLargerClass(size, alignment);
+      }
+
+      //
+      // Alignment padding is not lost, it goes to free lists.
+      //
+      PushFreeRange(_index, offset);
+
+      SetIndex(offset + size);
+
+      return PlaceBlock(offset, size, alignment);
+    }
+
+    void SetIndex(uint64_t index)
+    {
+      _index      = index;
+      _dirtyIndex = std::max(_dirtyIndex, index);
+    }
+
+    //
+    // Zeroes everything from the end of the arena up to dirty mark.
+    //
+    void ClearTail()
+    {
+      if (_dirtyIndex > _index)
+      {
+        std::memset(&_memory[_index], 0, _dirtyIndex - _index);
+      }
+
+      _dirtyIndex = _index;
+    }
+
+    uint64_t RoundToSizeClass(uint64_t size)
+    {
+      //
+      // Zero sized blocks still occupy one granule,
+      // so that every block has unique address.
+      //
+      if (size == 0)
+      {
+        return SizeClassGranularity;
+      }
+
+      return (size + SizeClassGranularity - 1)
+           / SizeClassGranularity
+           * SizeClassGranularity;
+    }
+
+    //
+    // Offset of the first address at or after index
+    // with given alignment. Since arena start is granule aligned,
+    // result is always a whole number of granules.
+    //
+    uint64_t AlignedOffset(uint64_t index, uint64_t alignment)
+    {
+      uintptr_t addr    = (uintptr_t)&_memory[0] + index;
+      uintptr_t aligned = (addr + alignment - 1)
+                        & ~(uintptr_t)(alignment - 1);
+
+      return index + (aligned - addr);
+    }
+
+    uint64_t GranuleOf(void* ptr)
+    {
+      char* p = (char*)ptr;
+      if (p < &_memory[0] or p >= &_memory[MemorySize])
+      {
+        return NoGranule;
+      }
+
+      uint64_t offset = p - &_memory[0];
+      if (offset % SizeClassGranularity != 0)
+      {
+        return NoGranule;
+      }
+
+      return offset / SizeClassGranularity;
+    }
+
+    void* PlaceBlock(uint64_t offset, uint64_t size, uint64_t alignment)
+    {
+      uint64_t granule = offset / SizeClassGranularity;
+
+      _blockGranules[granule]      = size / SizeClassGranularity;
+      _blockAlignmentLog2[granule] = __builtin_ctzll(alignment);
+
+      return &_memory[offset];
+    }
+
+    uint64_t BlockSizeAt(uint64_t granule) const
+    {
+      return uint64_t(_blockGranules[granule]) * SizeClassGranularity;
+    }
+
+    uint64_t BlockAlignmentAt(uint64_t granule) const
+    {
+      return uint64_t(1) << _blockAlignmentLog2[granule];
+    }
+
+    uint64_t FreeSizeAt(uint64_t granule) const
+    {
+      return uint64_t(_freeGranules[granule]) * SizeClassGranularity;
+    }
+
+    bool ResizeInPlace(uint64_t granule, uint64_t size, uint64_t alignment)
+    {
+      uint64_t offset = granule * SizeClassGranularity;
+
+      if (alignment == 0
+       or (alignment & (alignment - 1)) != 0
+       or AlignedOffset(offset, alignment) != offset)
+      {
+        return false;
+      }
+
+      if (size >= MemorySize)
+      {
+        return false;
+      }
+
+      uint64_t requestedEnd = offset + size;
+
+      size = RoundToSizeClass(size);
+
+      uint64_t end  = offset + BlockSizeAt(granule);
+      uint64_t need = offset + size;
+
+      if (need <= end)
+      {
+        //
+        // Rest of the last granule stays with the block,
+        // which can later grow back into it without clearing.
+        //
+        if (_zeroing != ZeroingPolicy::None)
+        {
+          std::memset(&_memory[requestedEnd], 0, need - requestedEnd);
+        }
+
+        if (_zeroing == ZeroingPolicy::Eager)
+        {
+          std::memset(&_memory[need], 0, end - need);
+        }
+
+        if (end == _index)
+        {
+          _index = need;
+        }
+        else
+        {
+          PushFreeRange(need, end);
+        }
+      }
+      else
+      {
+        //
+        // Collect free blocks right after this one,
+        // bump space counts too if they reach it.
+        //
+        uint64_t scan = end;
+        while (scan < need
+           and scan < _index
+           and _freeGranules[scan / SizeClassGranularity] != 0)
+        {
+          scan += FreeSizeAt(scan / SizeClassGranularity);
+        }
+
+        bool reachesTail = (scan == _index);
+
+        if (scan < need and not (reachesTail and need < MemorySize))
+        {
+          return false;
+        }
+
+        for (uint64_t i = end; i < scan; )
+        {
+          uint64_t freeSize = FreeSizeAt(i / SizeClassGranularity);
+          RemoveFreeBlock(i / SizeClassGranularity);
+          i += freeSize;
+        }
+
+        if (reachesTail)
+        {
+          SetIndex(need);
+        }
+        else
+        {
+          PushFreeRange(need, scan);
+        }
+
+        if (_zeroing == ZeroingPolicy::OnAlloc)
+        {
+          std::memset(&_memory[end], 0, need - end);
+        }
+      }
+
+      PlaceBlock(offset, size, alignment);
+
+      return true;
+    }
+
+    //
+    // Free lists are doubly linked, so that any free block
+    // can be taken out of its list, not just the head.
+    //
+    void PushFreeBlock(uint64_t granule, uint64_t cls)
+    {
+      uint64_t head = _freeListHead[cls];
+
+      _freeGranules[granule]    = cls;
+      _prevFreeGranule[granule] = NoGranule;
+      _nextFreeGranule[granule] = head;
+
+      if (head != NoGranule)
+      {
+        _prevFreeGranule[head] = granule;
+      }
+
+      _freeListHead[cls] = granule;
+    }
+
+    void RemoveFreeBlock(uint64_t granule)
+    {
+      uint64_t cls  = _freeGranules[granule];
+      uint64_t prev = _prevFreeGranule[granule];
+      uint64_t next = _nextFreeGranule[granule];
+
+      if (prev != NoGranule)
+      {
+        _nextFreeGranule[prev] = next;
+      }
+      else
+      {
+        _freeListHead[cls] = next;
+      }
+
+      if (next != NoGranule)
+      {
+        _prevFreeGranule[next] = prev;
+      }
+
+      _freeGranules[granule] = 0;
+    }
+
+    void PushFreeRange(uint64_t from, uint64_t to)
+    {
+      if (to > from)
+      {
+        PushFreeBlock(from / SizeClassGranularity,
+                      (to - from) / SizeClassGranularity);
+      }
+    }
+
+    uint64_t PopFreeBlock(uint64_t cls)
+    {
+      uint64_t granule = _freeListHead[cls];
+      RemoveFreeBlock(granule);
+
+      return granule;
+    }
+
+    //
+    // Bump pointer is exhausted: split the first free block that fits
+    // and put leading (alignment) and trailing parts back to their
+    // own size classes.
+    //
+    void* AllocFromLargerClass(uint64_t size, uint64_t alignment)
+    {
+      for (uint64_t cls = size / SizeClassGranularity;
+           cls <= SizeClasses;
+           cls++)
+      {
+        if (_freeListHead[cls] == NoGranule)
+        {
+          continue;
+        }
+
+        uint64_t start  = _freeListHead[cls] * SizeClassGranularity;
+        uint64_t end    = start + cls * SizeClassGranularity;
+        uint64_t offset = AlignedOffset(start, alignment);
+
+        if (offset + size > end)
+        {
+          continue;
+        }
+
+        PopFreeBlock(cls);
+
+        PushFreeRange(start, offset);
+        PushFreeRange(offset + size, end);
+
+        return PlaceBlock(offset, size, alignment);
+      }
+
+      return nullptr;
+    }
+
+    void ClearFreeLists()
+    {
+      for (auto& head : _freeListHead)
+      {
+        head = NoGranule;
+      }
+
+      std::memset(_freeGranules, 0, sizeof(_freeGranules));
+    }
+
+    alignas(SizeClassGranularity) char _memory[MemorySize];
+    uint64_t _index = 0;
+
+    //
+    // Everything at and after this offset is known to be zero.
+    //
+    uint64_t _dirtyIndex = 0;
+
+    ZeroingPolicy _zeroing = ZeroingPolicy::Eager;
+
+    uint32_t _blockGranules[Granules];
+    uint8_t  _blockAlignmentLog2[Granules];
+    uint32_t _freeGranules[Granules];
+    uint32_t _nextFreeGranule[Granules];
+    uint32_t _prevFreeGranule[Granules];
+    uint32_t _freeListHead[SizeClasses + 1];
+};
+
+#endif // include guard
@@ -0,0 +1,1546 @@
+#ifndef SMART_ALLOCATOR_H
+#define SMART_ALLOCATOR_H
+
+#include "alloc-trace.h"
+#include "arena-storage.h"
+#include "worker-pool.h"
+#include "zeroing-policy.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//
+// Blocks are referred to by handles: index into dense slot table
+// plus generation counter, which is bumped every time slot is freed.
+// Handle is resolved with single array lookup, and stale handle
+// is detected by generation mismatch. Since handles don't hold
+// addresses, Defragment() and ReAlloc() can move blocks freely.
+//
+// MaxBlocks == 0 lets slot table grow as needed, otherwise
+// it's allocated once for MaxBlocks slots and Alloc(), ReAlloc()
+// and Free() never touch the heap.
+//
+// Every block remembers its alignment, so Defragment()
+// keeps blocks aligned when it moves them.
+//
+// Blocks created with New<T>() remember how to move and destroy
+// their object, so Defragment() can relocate types that are not
+// trivially copyable and Free() / Reset() run their destructors.
+//
+// Pinned blocks are never moved: Defragment() leaves them in place
+// and fills free space before them with blocks from further up.
+//
+// Allocator keeps running statistics, GetStats() can be called
+// from any thread. Counters are only ever written by the owning thread,
+// so keeping them costs a few plain stores per operation.
+//
+// With trace recorder attached every operation is also appended
+// to allocation trace, handle is used as block id.
+//
+// Arena tracks the highest offset ever handed out since it was
+// last cleared, so zeroing never touches memory beyond it.
+//
+// Storage decides where arena memory comes from: InlineStorage embeds
+// it into the object, VirtualStorage only reserves MemorySize of address
+// space and commits pages as the arena grows, HugePageStorage does the
+// same on top of transparent huge pages. Reset() and Defragment()
+// give pages past the end of the arena back to the storage, which
+// drops them from RSS if it can.
+//
+// With worker pool attached, full Defragment() passes plan new
+// addresses first and copy blocks on all threads of the pool.
+//
+template <uint64_t MemorySize,
+          uint64_t MaxBlocks = 0,
+          template <uint64_t> class Storage = InlineStorage>
+class SmartAllocator
+{
+  public:
+    //
+    // Use as alignment to keep blocks on separate cache lines.
+    //
+    static const uint64_t CacheLineSize = 64;
+
+    struct BlockInfo
+    {
+      void* Addr    = nullptr;
+      uint64_t Size = 0;
+    };
+
+    struct Handle
+    {
+      uint32_t Index      = 0;
+      uint32_t Generation = 0;
+
+      bool IsNull() const
+      {
+        return (Generation == 0);
+      }
+    };
+
+    //
+    // Size bucket N counts allocations of up to 2^N bytes,
+    // the last one counts everything bigger.
+    //
+    static const uint64_t SizeBuckets = 16;
+
+    struct Stats
+    {
+      const char* Tag = "";
+
+      uint64_t Capacity      = 0;
+      uint64_t ArenaUsed     = 0;
+      uint64_t BytesLive     = 0;
+      uint64_t PeakBytesLive = 0;
+      uint64_t BlocksLive    = 0;
+
+      uint64_t Allocs   = 0;
+      uint64_t ReAllocs = 0;
+      uint64_t Frees    = 0;
+
+      uint64_t AllocsBySize[SizeBuckets] = {};
+
+      //
+      // As of the last TakeCensus().
+      //
+      uint64_t FreeBytes         = 0;
+      uint64_t LargestFreeExtent = 0;
+
+      uint64_t DefragmentPasses = 0;
+      std::chrono::nanoseconds DefragmentTime{0};
+
+      //
+      // 0 when all free space is one extent,
+      // close to 1 when it's scattered in small holes.
+      //
+      double Fragmentation() const
+      {
+        return (FreeBytes == 0)
+             ? 0.0
+             : 1.0 - (double)LargestFreeExtent / FreeBytes;
+      }
+    };
+
+    SmartAllocator(const std::string& tag = std::string(),
+                   ZeroingPolicy zeroing = ZeroingPolicy::Eager)
+      : _zeroing(zeroing)
+    {
+      //
+      // Arena is not clean yet, unless storage comes zeroed.
+      //
+      _dirtyIndex = Storage<MemorySize>::StartsZeroed ? 0 : MemorySize;
+
+      if (MaxBlocks != 0)
+      {
+        _slots.resize(MaxBlocks);
+      }
+
+      Reset();
+
+      _stats.Capacity.store(MemorySize, std::memory_order_relaxed);
+
+      if (not tag.empty())
+      {
+        _tag = tag;
+
+        printf("[SmartAllocator '%s']\n", _tag.data());
+      }
+
+      printf("Memory range: [0x%X - 0x%X]\n\n",
+             &_memory[0], &_memory[MemorySize - 1]);
+    }
+
+    ~SmartAllocator()
+    {
+      DestroyTypedBlocks();
+    }
+
+    //
+    // Arena memory might live inside the object.
+    //
+    SmartAllocator(const SmartAllocator&) = delete;
+    SmartAllocator& operator=(const SmartAllocator&) = delete;
+
+    //
+    // Alignment must be power of two.
+    //
+    Handle Alloc(uint64_t size, uint64_t alignment = 1)
+    {
+      uint64_t offset = 0;
+      if (not Reserve(size, alignment, offset))
+      {
+        return Handle();
+      }
+
+      uint32_t slot = NewSlot();
+      if (slot == NoSlot)
+      {
+        return Handle();
+      }
+
+      BlockSlot& bs = _slots[slot];
+      bs.Info.Addr = &_memory[offset];
+      bs.Info.Size = size;
+      bs.Alignment = alignment;
+
+      SetIndex(offset + size);
+
+      if (_zeroing == ZeroingPolicy::OnAlloc)
+      {
+        std::memset(bs.Info.Addr, 0, size);
+      }
+
+      Add(_stats.Allocs, 1);
+      Add(_stats.AllocsBySize[SizeBucketOf(size)], 1);
+      Add(_stats.BlocksLive, 1);
+      AddBytesLive(size);
+
+      Handle h = { slot, bs.Generation };
+
+      Trace(TraceOp::Alloc, h, size, alignment);
+
+      return h;
+    };
+
+    //
+    // Like calloc(): block is zeroed regardless of zeroing policy,
+    // but memory that is known to be clean is not touched again.
+    //
+    Handle AllocZeroed(uint64_t size, uint64_t alignment = 1)
+    {
+      Handle h = Alloc(size, alignment);
+
+      if (not h.IsNull() and _zeroing == ZeroingPolicy::None)
+      {
+        const BlockSlot& bs = _slots[h.Index];
+        std::memset(bs.Info.Addr, 0, bs.Info.Size);
+      }
+
+      return h;
+    }
+
+    //
+    // Constructs T in a new block.
+    //
+    template <typename T, typename... Args>
+    Handle New(Args&&... args)
+    {
+      Handle h = Alloc(sizeof(T), alignof(T));
+      if (h.IsNull())
+      {
+        return h;
+      }
+
+      BlockSlot& bs = _slots[h.Index];
+
+      try
+      {
+        new (bs.Info.Addr) T(std::forward<Args>(args)...);
+      }
+      catch (...)
+      {
+        Free(h);
+        throw;
+      }
+
+      bs.Ops = OpsFor<T>();
+
+      return h;
+    }
+
+    //
+    // Returns nullptr for stale or null handle.
+    //
+    template <typename T>
+    T* GetObject(Handle h) const
+    {
+      return (T*)Get(h).Addr;
+    }
+
+    //
+    // Handle stays the same, only block address might change.
+    // Block is resized in place if it shrinks or if there's enough
+    // free space after it, otherwise it's copied to the end of the arena.
+    // On failure null handle is returned and old block is left intact.
+    // Zero alignment keeps the one block was allocated with.
+    // Blocks created with New<T>() can't be resized,
+    // pinned blocks can only be resized in place.
+    //
+    Handle ReAlloc(Handle h, uint64_t size, uint64_t alignment = 0)
+    {
+      uint32_t slot = FindSlot(h);
+      if (slot == NoSlot)
+      {
+        return Handle();
+      }
+
+      BlockSlot& bs = _slots[slot];
+
+      if (bs.Ops != nullptr)
+      {
+        return Handle();
+      }
+
+      if (alignment == 0)
+      {
+        alignment = bs.Alignment;
+      }
+
+      uint64_t oldSize = bs.Info.Size;
+
+      if (ResizeInPlace(slot, size, alignment))
+      {
+        Add(_stats.ReAllocs, 1);
+        AddBytesLive(size - oldSize);
+
+        Trace(TraceOp::ReAlloc, h, size, alignment);
+
+        return h;
+      }
+
+      if (bs.PinCount != 0)
+      {
+        return Handle();
+      }
+
+      uint64_t offset = 0;
+      if (not Reserve(size, alignment, offset))
+      {
+        return Handle();
+      }
+
+      char* newAddr = &_memory[offset];
+
+      uint64_t copied = std::min(bs.Info.Size, size);
+
+      std::memcpy(newAddr, bs.Info.Addr, copied);
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        std::memset(bs.Info.Addr, 0, bs.Info.Size);
+      }
+      else if (_zeroing == ZeroingPolicy::OnAlloc)
+      {
+        std::memset(newAddr + copied, 0, size - copied);
+      }
+
+      bs.Info.Addr = newAddr;
+      bs.Info.Size = size;
+      bs.Alignment = alignment;
+
+      SetIndex(offset + size);
+
+      //
+      // Block is now the last one in the arena.
+      //
+      SkipDefragmentCursor(slot);
+      Unlink(slot);
+      LinkLast(slot);
+
+      Add(_stats.ReAllocs, 1);
+      AddBytesLive(size - oldSize);
+
+      Trace(TraceOp::ReAlloc, h, size, alignment);
+
+      return h;
+    };
+
+    void Free(Handle h)
+    {
+      uint32_t slot = FindSlot(h);
+      if (slot != NoSlot)
+      {
+        BlockSlot& bs = _slots[slot];
+
+        if (bs.Ops != nullptr)
+        {
+          bs.Ops->Destroy(bs.Info.Addr);
+        }
+
+        if (_zeroing == ZeroingPolicy::Eager)
+        {
+          std::memset(bs.Info.Addr, 0, bs.Info.Size);
+        }
+
+        Add(_stats.Frees, 1);
+        Add(_stats.BlocksLive, -1);
+        AddBytesLive(-bs.Info.Size);
+
+        Trace(TraceOp::Free, h, 0, 0);
+
+        SkipDefragmentCursor(slot);
+        ReleaseSlot(slot);
+      }
+    };
+
+    //
+    // Keeps block at its address until matching Unpin(),
+    // so it can be handed to I/O or to other threads.
+    // Pins nest.
+    //
+    bool Pin(Handle h)
+    {
+      uint32_t slot = FindSlot(h);
+      if (slot == NoSlot)
+      {
+        return false;
+      }
+
+      _slots[slot].PinCount++;
+
+      return true;
+    }
+
+    void Unpin(Handle h)
+    {
+      uint32_t slot = FindSlot(h);
+      if (slot != NoSlot and _slots[slot].PinCount != 0)
+      {
+        _slots[slot].PinCount--;
+      }
+    }
+
+    bool IsPinned(Handle h) const
+    {
+      uint32_t slot = FindSlot(h);
+      return (slot != NoSlot and _slots[slot].PinCount != 0);
+    }
+
+    //
+    // Returns "null reference" for stale or null handle.
+    //
+    BlockInfo Get(Handle h) const
+    {
+      uint32_t slot = FindSlot(h);
+      return (slot == NoSlot) ? _nullReference : _slots[slot].Info;
+    }
+
+    void Reset()
+    {
+      Trace(TraceOp::Reset, Handle(), 0, 0);
+
+      DestroyTypedBlocks();
+
+      ClearSlots();
+
+      _index = 0;
+
+      _stats.ArenaUsed.store(0, std::memory_order_relaxed);
+      _stats.BytesLive.store(0, std::memory_order_relaxed);
+      _stats.BlocksLive.store(0, std::memory_order_relaxed);
+
+      ReleaseTail();
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        ClearTail();
+      }
+
+      _defragInProgress = false;
+
+      TakeCensus();
+    }
+
+    //
+    // Recorder must outlive the allocator or be detached
+    // with nullptr before it's destroyed.
+    //
+    void SetTraceRecorder(TraceRecorder* recorder)
+    {
+      _recorder = recorder;
+    }
+
+    //
+    // Same rules as for trace recorder. DefragmentStep()
+    // always runs on the calling thread only.
+    //
+    void SetDefragmentWorkers(WorkerPool* workers)
+    {
+      _workers = workers;
+    }
+
+    //
+    // Can be called from any thread.
+    //
+    Stats GetStats() const
+    {
+      Stats st;
+
+      st.Tag = _tag.data();
+
+      st.Capacity      = Load(_stats.Capacity);
+      st.ArenaUsed     = Load(_stats.ArenaUsed);
+      st.BytesLive     = Load(_stats.BytesLive);
+      st.PeakBytesLive = Load(_stats.PeakBytesLive);
+      st.BlocksLive    = Load(_stats.BlocksLive);
+
+      st.Allocs   = Load(_stats.Allocs);
+      st.ReAllocs = Load(_stats.ReAllocs);
+      st.Frees    = Load(_stats.Frees);
+
+      for (uint64_t i = 0; i < SizeBuckets; i++)
+      {
+        st.AllocsBySize[i] = Load(_stats.AllocsBySize[i]);
+      }
+
+      st.FreeBytes         = Load(_stats.FreeBytes);
+      st.LargestFreeExtent = Load(_stats.LargestFreeExtent);
+
+      st.DefragmentPasses = Load(_stats.DefragmentPasses);
+      st.DefragmentTime   = std::chrono::nanoseconds(Load(_stats.DefragmentTime));
+
+      return st;
+    }
+
+    //
+    // Walks all blocks to find free space between them
+    // and updates fragmentation figures in statistics.
+    // Done automatically after every Defragment() pass and Reset().
+    //
+    void TakeCensus()
+    {
+      uint64_t freeBytes = 0;
+      uint64_t largest   = 0;
+      uint64_t end       = 0;
+
+      for (uint32_t slot = _firstSlot; slot != NoSlot; slot = _slots[slot].Next)
+      {
+        const BlockInfo& bi = _slots[slot].Info;
+
+        uint64_t offset = (char*)bi.Addr - &_memory[0];
+
+        freeBytes += offset - end;
+        largest    = std::max(largest, offset - end);
+
+        end = offset + bi.Size;
+      }
+
+      freeBytes += MemorySize - end;
+      largest    = std::max(largest, MemorySize - end);
+
+      _stats.FreeBytes.store(freeBytes, std::memory_order_relaxed);
+      _stats.LargestFreeExtent.store(largest, std::memory_order_relaxed);
+    }
+
+    void Defragment()
+    {
+      Trace(TraceOp::Defragment, Handle(), 0, 0);
+
+      DefragmentSteps([](uint64_t) { return true; }, _workers != nullptr);
+    }
+
+    //
+    // Incremental version of Defragment(): moves blocks until
+    // byteBudget bytes are copied and returns true when the pass
+    // is complete. Next call resumes from where the last one stopped.
+    // At least one block is moved per call, so every pass finishes.
+    //
+    // Alloc(), ReAlloc() and Free() can be called between steps.
+    //
+    bool DefragmentStep(uint64_t byteBudget)
+    {
+      Trace(TraceOp::DefragmentStep, Handle(), byteBudget, 0);
+
+      return DefragmentSteps([byteBudget](uint64_t bytesMoved)
+      {
+        return (bytesMoved < byteBudget);
+      });
+    }
+
+    //
+    // Same as above, but with time budget.
+    //
+    bool DefragmentStep(std::chrono::nanoseconds timeBudget)
+    {
+      Trace(TraceOp::DefragmentStepTime, Handle(), timeBudget.count(), 0);
+
+      auto deadline = std::chrono::steady_clock::now() + timeBudget;
+
+      return DefragmentSteps([deadline](uint64_t)
+      {
+        return (std::chrono::steady_clock::now() < deadline);
+      });
+    }
+
+  private:
+    static const uint32_t NoSlot = UINT32_MAX;
+
+    //
+    // Blocks are visited in address order and slid down to _defragIndex.
+    // Everything before _defragSlot is already compacted below
+    // _defragIndex, everything after it lies above, so moves
+    // never overlap with live blocks.
+    //
+    template <typename F>
+    bool DefragmentSteps(F canContinue, bool parallel = false)
+    {
+      DefragmentTimer timer(_stats);
+
+      if (not _defragInProgress)
+      {
+        _defragInProgress = true;
+        _defragSlot  = _firstSlot;
+        _defragIndex = 0;
+      }
+
+      uint64_t bytesMoved = 0;
+      bool anythingMoved  = false;
+
+      while (_defragSlot != NoSlot)
+      {
+        if (anythingMoved and not canContinue(bytesMoved))
+        {
+          return false;
+        }
+
+        if (parallel)
+        {
+          uint64_t moved = CompactInParallel();
+
+          bytesMoved   += moved;
+          anythingMoved = (anythingMoved or moved != 0);
+
+          if (_defragSlot == NoSlot)
+          {
+            break;
+          }
+        }
+
+        BlockSlot& bs = _slots[_defragSlot];
+        BlockInfo& bi = bs.Info;
+
+        if (bs.PinCount != 0)
+        {
+          if (not FillGap(_defragSlot, canContinue, bytesMoved, anythingMoved))
+          {
+            return false;
+          }
+
+          uint64_t end = (char*)bi.Addr - &_memory[0] + bi.Size;
+
+          _defragIndex = std::max(_defragIndex, end);
+          _defragSlot  = bs.Next;
+
+          continue;
+        }
+
+        uint64_t offset = AlignedOffset(_defragIndex, bs.Alignment);
+
+        char* addr = &_memory[offset];
+
+        //
+        // Everything at and after the cursor lies at or above
+        // _defragIndex, so blocks only ever move down.
+        //
+        assert(addr <= bi.Addr);
+
+        if (bi.Addr != addr and not MoveBlock(_defragSlot, addr))
+        {
+          //
+          // Block couldn't be moved, so it stays where it is.
+          //
+          offset = (char*)bi.Addr - &_memory[0];
+        }
+        else if (bi.Addr != addr)
+        {
+          char* from = (char*)bi.Addr;
+
+          bi.Addr = addr;
+
+          //
+          // Clear only what the block left behind,
+          // so that free space stays zeroed between steps.
+          //
+          if (_zeroing == ZeroingPolicy::Eager)
+          {
+            char* leftover = std::max(from, addr + bi.Size);
+            std::memset(leftover, 0, from + bi.Size - leftover);
+          }
+
+          bytesMoved   += bi.Size;
+          anythingMoved = true;
+        }
+
+        _defragIndex = offset + bi.Size;
+        _defragSlot   = _slots[_defragSlot].Next;
+      }
+
+      _index = _defragIndex;
+
+      //
+      // With eager zeroing everything past the last block is clean now.
+      //
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        _dirtyIndex = _index;
+      }
+
+      ReleaseTail();
+
+      _defragInProgress = false;
+
+      Add(_stats.DefragmentPasses, 1);
+
+      TakeCensus();
+
+      return true;
+    }
+
+    //
+    // Slides all plain blocks from the cursor up to the next pinned
+    // or typed one, which is left to the serial path. New addresses
+    // are assigned here, before anything is copied, so only RunPlan()
+    // touches the arena. Returns number of bytes moved.
+    //
+    uint64_t CompactInParallel()
+    {
+      _plan.clear();
+
+      uint64_t bytesMoved = 0;
+
+      while (_defragSlot != NoSlot)
+      {
+        BlockSlot& bs = _slots[_defragSlot];
+
+        if (bs.PinCount != 0 or bs.Ops != nullptr)
+        {
+          break;
+        }
+
+        uint64_t from = (char*)bs.Info.Addr - &_memory[0];
+        uint64_t to   = AlignedOffset(_defragIndex, bs.Alignment);
+        uint64_t size = bs.Info.Size;
+
+        assert(to <= from);
+
+        if (from != to)
+        {
+          //
+          // Neighbours that move by the same distance are copied as one.
+          //
+          Move* last = _plan.empty() ? nullptr : &_plan.back();
+
+          if (last != nullptr
+           and last->From + last->Size == from
+           and last->From - last->To == from - to)
+          {
+            last->Size += size;
+          }
+          else
+          {
+            _plan.push_back({ from, to, size });
+          }
+
+          bs.Info.Addr = &_memory[to];
+          bytesMoved  += size;
+        }
+
+        _defragIndex = to + size;
+        _defragSlot  = bs.Next;
+      }
+
+      RunPlan();
+
+      return bytesMoved;
+    }
+
+    //
+    // Blocks only ever move down, so a copy can overwrite sources
+    // of copies before it and never of the ones after it.
+    // Copies are split into chunks and run in batches: chunk joins
+    // the batch if it lands below everything the batch reads from.
+    // Block that moves by less than MinParallelShift overlaps itself
+    // and is copied with single memmove().
+    //
+    void RunPlan()
+    {
+      _chunks.clear();
+
+      for (const Move& m : _plan)
+      {
+        uint64_t shift = m.From - m.To;
+        uint64_t chunk = ParallelChunkSize;
+
+        if (shift < m.Size)
+        {
+          chunk = (shift >= MinParallelShift) ? std::min(chunk, shift) : m.Size;
+        }
+
+        for (uint64_t done = 0; done < m.Size; done += chunk)
+        {
+          _chunks.push_back({ m.From + done, m.To + done, std::min(chunk, m.Size - done) });
+        }
+      }
+
+      uint64_t first = 0;
+
+      while (first < _chunks.size())
+      {
+        uint64_t last = first + 1;
+
+        while (last < _chunks.size()
+           and _chunks[last].To + _chunks[last].Size <= _chunks[first].From)
+        {
+          last++;
+        }
+
+        _workers->Run(last - first, [this, first](uint64_t i)
+        {
+          const Move& c = _chunks[first + i];
+          std::memmove(&_memory[c.To], &_memory[c.From], c.Size);
+        });
+
+        first = last;
+      }
+
+      if (_zeroing != ZeroingPolicy::Eager)
+      {
+        return;
+      }
+
+      //
+      // Clear what blocks left behind: sources not covered
+      // by any destination. Both lists are sorted.
+      //
+      _chunks.clear();
+
+      uint64_t chunk = ParallelChunkSize;
+      uint64_t dest  = 0;
+
+      for (const Move& m : _plan)
+      {
+        uint64_t pos = m.From;
+        uint64_t end = m.From + m.Size;
+
+        while (pos < end)
+        {
+          while (dest < _plan.size() and _plan[dest].To + _plan[dest].Size <= pos)
+          {
+            dest++;
+          }
+
+          uint64_t covered = (dest < _plan.size()) ? _plan[dest].To : end;
+          uint64_t clear   = std::min(covered, end);
+
+          for (uint64_t at = pos; at < clear; at += chunk)
+          {
+            _chunks.push_back({ 0, at, std::min<uint64_t>(clear - at, chunk) });
+          }
+
+          if (covered >= end)
+          {
+            break;
+          }
+
+          pos = std::max(pos, _plan[dest].To + _plan[dest].Size);
+        }
+      }
+
+      _workers->Run(_chunks.size(), [this](uint64_t i)
+      {
+        const Move& c = _chunks[i];
+        std::memset(&_memory[c.To], 0, c.Size);
+      });
+    }
+
+    //
+    // Moves blocks that lie after pinned one into free space
+    // between _defragIndex and the pinned block, first fit
+    // in address order. Returns false when out of budget,
+    // cursor then stays at the pinned block.
+    //
+    template <typename F>
+    bool FillGap(uint32_t pinned,
+                 F& canContinue,
+                 uint64_t& bytesMoved,
+                 bool& anythingMoved)
+    {
+      uint64_t gapEnd = (char*)_slots[pinned].Info.Addr - &_memory[0];
+
+      uint32_t slot = _slots[pinned].Next;
+
+      while (slot != NoSlot and _defragIndex < gapEnd)
+      {
+        BlockSlot& bs = _slots[slot];
+        uint32_t next = bs.Next;
+
+        uint64_t offset = AlignedOffset(_defragIndex, bs.Alignment);
+
+        if (bs.PinCount == 0 and offset + bs.Info.Size <= gapEnd)
+        {
+          if (anythingMoved and not canContinue(bytesMoved))
+          {
+            return false;
+          }
+
+          char* from = (char*)bs.Info.Addr;
+
+          assert(&_memory[offset] <= from);
+
+          if (MoveBlock(slot, &_memory[offset]))
+          {
+            bs.Info.Addr = &_memory[offset];
+
+            if (_zeroing == ZeroingPolicy::Eager)
+            {
+              std::memset(from, 0, bs.Info.Size);
+            }
+
+            Unlink(slot);
+            LinkBefore(slot, pinned);
+
+            _defragIndex = offset + bs.Info.Size;
+
+            bytesMoved   += bs.Info.Size;
+            anythingMoved = true;
+          }
+        }
+
+        slot = next;
+      }
+
+      return true;
+    }
+
+    //
+    // Typed blocks are moved by their relocation thunk, which can't
+    // handle overlapping ranges, so such moves bounce through free space
+    // at the end of the arena. Returns false if there's no room for that.
+    // Block address is not updated here.
+    //
+    bool MoveBlock(uint32_t slot, char* to)
+    {
+      const BlockSlot& bs = _slots[slot];
+
+      char* from    = (char*)bs.Info.Addr;
+      uint64_t size = bs.Info.Size;
+
+      if (bs.Ops == nullptr)
+      {
+        std::memmove(to, from, size);
+        return true;
+      }
+
+      if (to + size <= from or from + size <= to)
+      {
+        bs.Ops->Relocate(to, from);
+        return true;
+      }
+
+      uint64_t offset = 0;
+      if (not Reserve(size, bs.Alignment, offset))
+      {
+        return false;
+      }
+
+      char* bounce = &_memory[offset];
+
+      bs.Ops->Relocate(bounce, from);
+      bs.Ops->Relocate(to, bounce);
+
+      if (_zeroing == ZeroingPolicy::Eager)
+      {
+        std::memset(bounce, 0, size);
+      }
+      else
+      {
+        _dirtyIndex = std::max(_dirtyIndex, offset + size);
+      }
+
+      return true;
+    }
+
+    void SetIndex(uint64_t index)
+    {
+      _index      = index;
+      _dirtyIndex = std::max(_dirtyIndex, index);
+
+      _stats.ArenaUsed.store(index, std::memory_order_relaxed);
+    }
+
+    //
+    // Zeroes everything from the end of the arena up to dirty mark.
+    //
+    void ClearTail()
+    {
+      if (_dirtyIndex > _index)
+      {
+        std::memset(&_memory[_index], 0, _dirtyIndex - _index);
+      }
+
+      _dirtyIndex = _index;
+    }
+
+    //
+    // Released memory reads as zeros, so dirty mark can be lowered.
+    //
+    void ReleaseTail()
+    {
+      _dirtyIndex = std::min(_dirtyIndex, _storage.Release(_index));
+    }
+
+    //
+    // Offset of the first address at or after index
+    // with given alignment.
+    //
+    uint64_t AlignedOffset(uint64_t index, uint64_t alignment)
+    {
+      uintptr_t addr    = (uintptr_t)&_memory[0] + index;
+      uintptr_t aligned = (addr + alignment - 1)
+                        & ~(uintptr_t)(alignment - 1);
+
+      return index + (aligned - addr);
+    }
+
+    //
+    // Finds aligned place for the block at the end of the arena.
+    //
+    bool Reserve(uint64_t size, uint64_t alignment, uint64_t& offset)
+    {
+      if (alignment == 0 or (alignment & (alignment - 1)) != 0)
+      {
+        return false;
+      }
+
+      offset = AlignedOffset(_index, alignment);
+
+      //
+      // Compared without adding up, huge sizes would wrap around.
+      //
+      if (offset >= MemorySize or size >= MemorySize - offset)
+      {
+        return false;
+      }
+
+      return _storage.Commit(offset + size);
+    }
+
+    //
+    // Block can stay where it is if it's still properly aligned
+    // and new size fits before the next block or arena end.
+    //
+    bool ResizeInPlace(uint32_t slot, uint64_t size, uint64_t alignment)
+    {
+      BlockSlot& bs = _slots[slot];
+
+      if (alignment == 0
+       or (alignment & (alignment - 1)) != 0
+       or (uintptr_t)bs.Info.Addr % alignment != 0)
+      {
+        return false;
+      }
+
+      uint64_t offset = (char*)bs.Info.Addr - &_memory[0];
+
+      if (size >= MemorySize - offset)
+      {
+        return false;
+      }
+
+      uint64_t oldEnd = offset + bs.Info.Size;
+      uint64_t newEnd = offset + size;
+
+      if (bs.Next != NoSlot)
+      {
+        uint64_t next = (char*)_slots[bs.Next].Info.Addr - &_memory[0];
+        if (newEnd > next)
+        {
+          return false;
+        }
+      }
+      else if (newEnd >= MemorySize or not _storage.Commit(newEnd))
+      {
+        return false;
+      }
+
+      if (newEnd < oldEnd and _zeroing == ZeroingPolicy::Eager)
+      {
+        std::memset(&_memory[newEnd], 0, oldEnd - newEnd);
+      }
+
+      if (newEnd > oldEnd and _zeroing == ZeroingPolicy::OnAlloc)
+      {
+        std::memset(&_memory[oldEnd], 0, newEnd - oldEnd);
+      }
+
+      bs.Info.Size = size;
+      bs.Alignment = alignment;
+
+      //
+      // Everything after the last block is free.
+      //
+      if (bs.Next == NoSlot)
+      {
+        SetIndex(newEnd);
+      }
+
+      //
+      // Block that was already compacted by unfinished defragment pass
+      // must stay below the compacted boundary.
+      //
+      if (IsCompacted(slot))
+      {
+        //
+        // New blocks go right after the last one,
+        // so boundary can't stay above its end.
+        //
+        _defragIndex = (bs.Next == NoSlot)
+                     ? newEnd
+                     : std::max(_defragIndex, newEnd);
+      }
+
+      return true;
+    }
+
+    //
+    // Whether unfinished defragment pass has already passed the block.
+    // Zero sized blocks can share address with the block under
+    // the cursor, so offsets alone can't tell, list order decides.
+    //
+    bool IsCompacted(uint32_t slot) const
+    {
+      if (not _defragInProgress or slot == _defragSlot)
+      {
+        return false;
+      }
+
+      if (_defragSlot == NoSlot)
+      {
+        return true;
+      }
+
+      char* addr   = (char*)_slots[slot].Info.Addr;
+      char* cursor = (char*)_slots[_defragSlot].Info.Addr;
+
+      if (addr != cursor)
+      {
+        return (addr < cursor);
+      }
+
+      for (uint32_t prev = _slots[_defragSlot].Prev;
+           prev != NoSlot and _slots[prev].Info.Addr == cursor;
+           prev = _slots[prev].Prev)
+      {
+        if (prev == slot)
+        {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    //
+    // Block under defragment cursor is about to be unlinked.
+    //
+    void SkipDefragmentCursor(uint32_t slot)
+    {
+      if (_defragInProgress and _defragSlot == slot)
+      {
+        _defragSlot = _slots[slot].Next;
+      }
+    }
+
+    //
+    // Offsets into the arena.
+    //
+    struct Move
+    {
+      uint64_t From = 0;
+      uint64_t To   = 0;
+      uint64_t Size = 0;
+    };
+
+    static const uint64_t ParallelChunkSize = 1024 * 1024;
+    static const uint64_t MinParallelShift  = 64 * 1024;
+
+    //
+    // Written only by the owning thread, so updates don't need
+    // atomic read-modify-write, atomics are only there
+    // for GetStats() from other threads.
+    //
+    struct StatCounters
+    {
+      std::atomic<uint64_t> Capacity{0};
+      std::atomic<uint64_t> ArenaUsed{0};
+      std::atomic<uint64_t> BytesLive{0};
+      std::atomic<uint64_t> PeakBytesLive{0};
+      std::atomic<uint64_t> BlocksLive{0};
+
+      std::atomic<uint64_t> Allocs{0};
+      std::atomic<uint64_t> ReAllocs{0};
+      std::atomic<uint64_t> Frees{0};
+
+      std::atomic<uint64_t> AllocsBySize[SizeBuckets] = {};
+
+      std::atomic<uint64_t> FreeBytes{0};
+      std::atomic<uint64_t> LargestFreeExtent{0};
+
+      std::atomic<uint64_t> DefragmentPasses{0};
+      std::atomic<uint64_t> DefragmentTime{0};
+    };
+
+    //
+    // Adds time spent in a single defragment step.
+    //
+    class DefragmentTimer
+    {
+      public:
+        DefragmentTimer(StatCounters& stats)
+          : _stats(stats),
+            _started(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~DefragmentTimer()
+        {
+          auto elapsed = std::chrono::steady_clock::now() - _started;
+
+          Add(_stats.DefragmentTime,
+              std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+      private:
+        StatCounters& _stats;
+        std::chrono::steady_clock::time_point _started;
+    };
+
+    static void Add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + value,
+                    std::memory_order_relaxed);
+    }
+
+    static uint64_t Load(const std::atomic<uint64_t>& counter)
+    {
+      return counter.load(std::memory_order_relaxed);
+    }
+
+    void AddBytesLive(uint64_t delta)
+    {
+      Add(_stats.BytesLive, delta);
+
+      uint64_t live = Load(_stats.BytesLive);
+      if (live > Load(_stats.PeakBytesLive))
+      {
+        _stats.PeakBytesLive.store(live, std::memory_order_relaxed);
+      }
+    }
+
+    void Trace(TraceOp op, Handle h, uint64_t size, uint64_t alignment)
+    {
+      if (_recorder != nullptr)
+      {
+        uint64_t id = ((uint64_t)h.Generation << 32) | h.Index;
+        _recorder->Record(op, id, size, alignment);
+      }
+    }
+
+    static uint64_t SizeBucketOf(uint64_t size)
+    {
+      if (size <= 1)
+      {
+        return 0;
+      }
+
+      return std::min<uint64_t>(64 - __builtin_clzll(size - 1), SizeBuckets - 1);
+    }
+
+    //
+    // Relocate() move-constructs object at 'to' and destroys
+    // the one at 'from', ranges must not overlap.
+    //
+    struct TypeOps
+    {
+      void (*Relocate)(void* to, void* from);
+      void (*Destroy)(void* object);
+    };
+
+    //
+    // Trivial types are moved with memmove() and need no destructor.
+    //
+    template <typename T>
+    static const TypeOps* OpsFor()
+    {
+      if constexpr (std::is_trivially_copyable<T>::value
+                and std::is_trivially_destructible<T>::value)
+      {
+        return nullptr;
+      }
+      else
+      {
+        static const TypeOps ops =
+        {
+          [](void* to, void* from)
+          {
+            T* object = (T*)from;
+            new (to) T(std::move(*object));
+            object->~T();
+          },
+          [](void* object)
+          {
+            ((T*)object)->~T();
+          }
+        };
+
+        return &ops;
+      }
+    }
+
+    //
+    // Slots of live blocks are linked in address order
+    // so that Defragment() can walk them without sorting.
+    // Free slots are chained through Next.
+    //
+    struct BlockSlot
+    {
+      BlockInfo Info;
+      uint64_t Alignment = 1;
+
+      const TypeOps* Ops = nullptr;
+
+      uint32_t PinCount = 0;
+
+      uint32_t Generation = 1;
+      bool IsLive         = false;
+
+      uint32_t Prev = NoSlot;
+      uint32_t Next = NoSlot;
+    };
+
+    uint32_t FindSlot(Handle h) const
+    {
+      if (h.Index >= _slots.size())
+      {
+        return NoSlot;
+      }
+
+      const BlockSlot& bs = _slots[h.Index];
+      if (not bs.IsLive or bs.Generation != h.Generation)
+      {
+        return NoSlot;
+      }
+
+      return h.Index;
+    }
+
+    uint32_t NewSlot()
+    {
+      if (_freeSlot == NoSlot)
+      {
+        if (MaxBlocks != 0 or _slots.size() >= NoSlot)
+        {
+          return NoSlot;
+        }
+
+        _slots.emplace_back();
+        _freeSlot = _slots.size() - 1;
+      }
+
+      uint32_t slot = _freeSlot;
+      _freeSlot = _slots[slot].Next;
+
+      _slots[slot].IsLive = true;
+
+      //
+      // New blocks are always bumped at the end of the arena.
+      //
+      LinkLast(slot);
+
+      return slot;
+    }
+
+    void ReleaseSlot(uint32_t slot)
+    {
+      Unlink(slot);
+
+      BlockSlot& bs = _slots[slot];
+
+      bs.Info     = _nullReference;
+      bs.Ops      = nullptr;
+      bs.PinCount = 0;
+      bs.IsLive   = false;
+      bs.Next     = _freeSlot;
+
+      BumpGeneration(bs);
+
+      _freeSlot = slot;
+    }
+
+    void BumpGeneration(BlockSlot& bs)
+    {
+      bs.Generation++;
+
+      //
+      // Zero generation is reserved for null handle.
+      //
+      if (bs.Generation == 0)
+      {
+        bs.Generation = 1;
+      }
+    }
+
+    void LinkLast(uint32_t slot)
+    {
+      BlockSlot& bs = _slots[slot];
+
+      bs.Prev = _lastSlot;
+      bs.Next = NoSlot;
+
+      if (_lastSlot != NoSlot)
+      {
+        _slots[_lastSlot].Next = slot;
+      }
+      else
+      {
+        _firstSlot = slot;
+      }
+
+      _lastSlot = slot;
+
+      //
+      // Defragment pass must not finish before it reaches this block.
+      //
+      if (_defragInProgress and _defragSlot == NoSlot)
+      {
+        _defragSlot = slot;
+      }
+    }
+
+    void LinkBefore(uint32_t slot, uint32_t before)
+    {
+      BlockSlot& bs = _slots[slot];
+
+      bs.Prev = _slots[before].Prev;
+      bs.Next = before;
+
+      if (bs.Prev != NoSlot)
+      {
+        _slots[bs.Prev].Next = slot;
+      }
+      else
+      {
+        _firstSlot = slot;
+      }
+
+      _slots[before].Prev = slot;
+    }
+
+    void Unlink(uint32_t slot)
+    {
+      BlockSlot& bs = _slots[slot];
+
+      if (bs.Prev != NoSlot)
+      {
+        _slots[bs.Prev].Next = bs.Next;
+      }
+      else
+      {
+        _firstSlot = bs.Next;
+      }
+
+      if (bs.Next != NoSlot)
+      {
+        _slots[bs.Next].Prev = bs.Prev;
+      }
+      else
+      {
+        _lastSlot = bs.Prev;
+      }
+
+      bs.Prev = NoSlot;
+      bs.Next = NoSlot;
+    }
+
+    //
+    // Runs destructors of objects created with New<T>().
+    //
+    void DestroyTypedBlocks()
+    {
+      for (uint32_t slot = _firstSlot; slot != NoSlot; slot = _slots[slot].Next)
+      {
+        const BlockSlot& bs = _slots[slot];
+
+        if (bs.Ops != nullptr)
+        {
+          bs.Ops->Destroy(bs.Info.Addr);
+        }
+      }
+    }
+
+    //
+    // Slots are kept (not shrunk) so that generation counters
+    // survive and all outstanding handles become stale.
+    //
+    void ClearSlots()
+    {
+      uint32_t slots = _slots.size();
+
+      for (uint32_t slot = 0; slot < slots; slot++)
+      {
+        BlockSlot& bs = _slots[slot];
+
+        if (bs.IsLive)
+        {
+          BumpGeneration(bs);
+        }
+
+        bs.Info     = _nullReference;
+        bs.Ops      = nullptr;
+        bs.PinCount = 0;
+        bs.IsLive   = false;
+        bs.Prev     = NoSlot;
+        bs.Next     = (slot + 1 < slots) ? slot + 1 : NoSlot;
+      }
+
+      _freeSlot  = (slots != 0) ? 0 : NoSlot;
+      _firstSlot = NoSlot;
+      _lastSlot  = NoSlot;
+    }
+
+    Storage<MemorySize> _storage;
+
+    char* _memory = _storage.Data();
+    uint64_t _index = 0;
+
+    //
+    // Everything at and after this offset is known to be zero.
+    //
+    uint64_t _dirtyIndex = 0;
+
+    ZeroingPolicy _zeroing = ZeroingPolicy::Eager;
+
+    std::vector<BlockSlot> _slots;
+    uint32_t _freeSlot  = NoSlot;
+    uint32_t _firstSlot = NoSlot;
+    uint32_t _lastSlot  = NoSlot;
+
+    bool _defragInProgress = false;
+    uint32_t _defragSlot   = NoSlot;
+    uint64_t _defragIndex  = 0;
+
+    const BlockInfo _nullReference = { nullptr, 0 };
+
+    StatCounters _stats;
+
+    TraceRecorder* _recorder = nullptr;
+
+    WorkerPool* _workers = nullptr;
+
+    std::vector<Move> _plan;
+    std::vector<Move> _chunks;
+
+    std::string _tag;
+};
+
+#endif // include guard
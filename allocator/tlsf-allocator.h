@@ -0,0 +1,493 @@
+#ifndef TLSF_ALLOCATOR_H
+#define TLSF_ALLOCATOR_H
+
+#include "arena-storage.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+//
+// Two-level segregated fit allocator.
+//
+// Free blocks are kept in lists indexed by two levels:
+// first level is power of two of the block size,
+// second level splits that range linearly into SLCount parts.
+// Non-empty lists are tracked by bitmaps, so finding suitable block
+// is a couple of bit scans, and neighbours are merged right on Free(),
+// which makes every operation O(1) regardless of fragmentation.
+//
+// Block header with BlockInfo lives in the arena right before the payload.
+//
+// Blocks can be anywhere in the arena, so storage is committed
+// as a whole. With VirtualStorage pages still become resident
+// only when they are touched.
+//
+template <uint64_t MemorySize,
+          template <uint64_t> class Storage = InlineStorage>
+class TlsfAllocator
+{
+  public:
+    struct BlockInfo
+    {
+      uint64_t Id   = 0;
+      void* Addr    = nullptr;
+      uint64_t Size = 0;
+    };
+
+    //
+    // Nothing is printed for untagged allocator,
+    // so it can be used where stdio is not available yet.
+    //
+    TlsfAllocator(const std::string& tag = std::string())
+    {
+      _blockUniqueId = 1;
+
+      if (not _storage.Commit(MemorySize))
+      {
+        _memory = nullptr;
+        return;
+      }
+
+      Reset();
+
+      if (not tag.empty())
+      {
+        _tag = tag;
+
+        printf("[TlsfAllocator '%s']\n", _tag.data());
+
+        printf("Memory range: [%p - %p]\n\n",
+               &_memory[0], &_memory[MemorySize - 1]);
+      }
+    }
+
+    TlsfAllocator(const TlsfAllocator&) = delete;
+    TlsfAllocator& operator=(const TlsfAllocator&) = delete;
+
+    const BlockInfo& Alloc(uint64_t size)
+    {
+      if (_memory == nullptr or size > MaxAllocSize)
+      {
+        return _nullReference;
+      }
+
+      uint64_t blockSize = BlockSizeFor(size);
+
+      int fl = 0;
+      int sl = 0;
+      if (not MappingSearch(blockSize, fl, sl))
+      {
+        return _nullReference;
+      }
+
+      BlockHeader* block = FindSuitableBlock(fl, sl);
+      if (block == nullptr)
+      {
+        return _nullReference;
+      }
+
+      RemoveFreeBlock(block, fl, sl);
+      TrimBlock(block, blockSize);
+
+      block->IsFree    = false;
+      block->Info.Id   = _blockUniqueId++;
+      block->Info.Addr = Payload(block);
+      block->Info.Size = size;
+
+      return block->Info;
+    };
+
+    const BlockInfo& ReAlloc(const BlockInfo& bi, uint64_t size)
+    {
+      BlockHeader* block = FindBlock(bi);
+      if (block == nullptr or size > MaxAllocSize)
+      {
+        return _nullReference;
+      }
+
+      uint64_t blockSize = BlockSizeFor(size);
+
+      //
+      // Try to grow into the next block if it's free.
+      //
+      BlockHeader* next = NextPhysical(block);
+      if (blockSize > block->BlockSize
+       and next != nullptr
+       and next->IsFree
+       and block->BlockSize + next->BlockSize >= blockSize)
+      {
+        RemoveFreeBlock(next);
+        Absorb(block, next);
+      }
+
+      if (blockSize <= block->BlockSize)
+      {
+        TrimBlock(block, blockSize);
+        block->Info.Size = size;
+        return block->Info;
+      }
+
+      const BlockInfo& newBlock = Alloc(size);
+      if (newBlock.Addr == nullptr)
+      {
+        return _nullReference;
+      }
+
+      std::memcpy(newBlock.Addr,
+                  block->Info.Addr,
+                  std::min(block->Info.Size, size));
+
+      Free(block->Info);
+
+      return newBlock;
+    };
+
+    void Free(const BlockInfo& blockToFree)
+    {
+      BlockHeader* block = FindBlock(blockToFree);
+      if (block == nullptr)
+      {
+        return;
+      }
+
+      std::memset(block->Info.Addr, 0, block->Info.Size);
+
+      block->IsFree = true;
+      block->Info   = _nullReference;
+
+      BlockHeader* prev = block->PrevPhysical;
+      if (prev != nullptr and prev->IsFree)
+      {
+        RemoveFreeBlock(prev);
+        Absorb(prev, block);
+        block = prev;
+      }
+
+      BlockHeader* next = NextPhysical(block);
+      if (next != nullptr and next->IsFree)
+      {
+        RemoveFreeBlock(next);
+        Absorb(block, next);
+      }
+
+      InsertFreeBlock(block);
+    };
+
+    //
+    // Memory given back to the storage reads as zeros,
+    // so only the rest has to be cleared.
+    //
+    void Reset()
+    {
+      if (_memory == nullptr)
+      {
+        return;
+      }
+
+      uint64_t clean = std::min(_storage.Release(0), MemorySize);
+      std::memset(_memory, 0, clean);
+
+      _flBitmap = 0;
+      std::memset(_slBitmap, 0, sizeof(_slBitmap));
+      std::memset(_freeLists, 0, sizeof(_freeLists));
+
+      BlockHeader* block = (BlockHeader*)&_memory[0];
+      block->BlockSize = ArenaSize;
+      block->IsFree    = true;
+
+      InsertFreeBlock(block);
+    }
+
+    //
+    // True if pointer lies inside the arena.
+    //
+    bool Contains(const void* ptr) const
+    {
+      const char* p = (const char*)ptr;
+      return (_memory != nullptr and p >= _memory and p < _memory + MemorySize);
+    }
+
+  private:
+    struct BlockHeader
+    {
+      BlockInfo Info;
+
+      //
+      // Includes header itself.
+      //
+      uint64_t BlockSize = 0;
+      bool IsFree        = false;
+
+      BlockHeader* PrevPhysical = nullptr;
+
+      //
+      // Valid only for free blocks.
+      //
+      BlockHeader* NextFree = nullptr;
+      BlockHeader* PrevFree = nullptr;
+    };
+
+    static constexpr uint64_t Alignment  = 16;
+    static constexpr uint64_t HeaderSize = (sizeof(BlockHeader) + Alignment - 1)
+                                         / Alignment
+                                         * Alignment;
+
+    static constexpr uint64_t MinBlockSize = HeaderSize + Alignment;
+    static constexpr uint64_t ArenaSize    = MemorySize / Alignment * Alignment;
+
+    //
+    // Index of the most significant set bit.
+    //
+    static constexpr int Fls(uint64_t value)
+    {
+      return (value == 0) ? -1 : 63 - __builtin_clzll(value);
+    }
+
+    //
+    // Blocks smaller than SmallBlockSize all go to first level 0,
+    // which is split linearly with Alignment step.
+    //
+    static constexpr int SLCountLog2 = 4;
+    static constexpr int SLCount     = 1 << SLCountLog2;
+    static constexpr int FLShift     = SLCountLog2 + Fls(Alignment);
+
+    static constexpr uint64_t SmallBlockSize = uint64_t(1) << FLShift;
+
+    static constexpr int FLCount = (ArenaSize < SmallBlockSize)
+                                 ? 1
+                                 : Fls(ArenaSize) - FLShift + 2;
+
+    //
+    // Anything bigger can't fit the arena,
+    // and would wrap around in BlockSizeFor().
+    //
+    static constexpr uint64_t MaxAllocSize = ArenaSize - HeaderSize;
+
+    static_assert(ArenaSize >= MinBlockSize, "Arena is too small");
+    static_assert(FLCount <= 64, "Arena is too big");
+
+    uint64_t BlockSizeFor(uint64_t size)
+    {
+      uint64_t blockSize = HeaderSize
+                         + (size + Alignment - 1) / Alignment * Alignment;
+
+      return std::max(blockSize, MinBlockSize);
+    }
+
+    void* Payload(BlockHeader* block)
+    {
+      return (char*)block + HeaderSize;
+    }
+
+    BlockHeader* NextPhysical(BlockHeader* block)
+    {
+      char* next = (char*)block + block->BlockSize;
+      if (next >= &_memory[ArenaSize])
+      {
+        return nullptr;
+      }
+
+      return (BlockHeader*)next;
+    }
+
+    BlockHeader* FindBlock(const BlockInfo& bi)
+    {
+      char* p = (char*)bi.Addr;
+      if (bi.Id == 0
+       or p < &_memory[HeaderSize]
+       or p >= &_memory[ArenaSize]
+       or (p - &_memory[0]) % Alignment != 0)
+      {
+        return nullptr;
+      }
+
+      BlockHeader* block = (BlockHeader*)(p - HeaderSize);
+      if (block->IsFree or block->Info.Id != bi.Id)
+      {
+        return nullptr;
+      }
+
+      return block;
+    }
+
+    void MappingInsert(uint64_t size, int& fl, int& sl)
+    {
+      if (size < SmallBlockSize)
+      {
+        fl = 0;
+        sl = size / (SmallBlockSize / SLCount);
+      }
+      else
+      {
+        int f = Fls(size);
+        sl = (size >> (f - SLCountLog2)) ^ (1 << SLCountLog2);
+        fl = f - FLShift + 1;
+      }
+    }
+
+    //
+    // Rounds size up to the next list boundary,
+    // so that any block from the found list is big enough.
+    //
+    bool MappingSearch(uint64_t size, int& fl, int& sl)
+    {
+      if (size >= SmallBlockSize)
+      {
+        size += (uint64_t(1) << (Fls(size) - SLCountLog2)) - 1;
+      }
+
+      MappingInsert(size, fl, sl);
+
+      return (fl < FLCount);
+    }
+
+    BlockHeader* FindSuitableBlock(int& fl, int& sl)
+    {
+      uint32_t slMap = _slBitmap[fl] & (~uint32_t(0) << sl);
+      if (slMap == 0)
+      {
+        uint64_t flMap = (fl + 1 < 64)
+                       ? _flBitmap & (~uint64_t(0) << (fl + 1))
+                       : 0;
+        if (flMap == 0)
+        {
+          return nullptr;
+        }
+
+        fl    = __builtin_ctzll(flMap);
+        slMap = _slBitmap[fl];
+      }
+
+      sl = __builtin_ctz(slMap);
+
+      return _freeLists[fl][sl];
+    }
+
+    void InsertFreeBlock(BlockHeader* block)
+    {
+      int fl = 0;
+      int sl = 0;
+      MappingInsert(block->BlockSize, fl, sl);
+
+      BlockHeader* head = _freeLists[fl][sl];
+
+      block->PrevFree = nullptr;
+      block->NextFree = head;
+
+      if (head != nullptr)
+      {
+        head->PrevFree = block;
+      }
+
+      _freeLists[fl][sl] = block;
+
+      _flBitmap     |= (uint64_t(1) << fl);
+      _slBitmap[fl] |= (uint32_t(1) << sl);
+    }
+
+    void RemoveFreeBlock(BlockHeader* block, int fl, int sl)
+    {
+      if (block->PrevFree != nullptr)
+      {
+        block->PrevFree->NextFree = block->NextFree;
+      }
+      else
+      {
+        _freeLists[fl][sl] = block->NextFree;
+      }
+
+      if (block->NextFree != nullptr)
+      {
+        block->NextFree->PrevFree = block->PrevFree;
+      }
+
+      block->NextFree = nullptr;
+      block->PrevFree = nullptr;
+
+      if (_freeLists[fl][sl] == nullptr)
+      {
+        _slBitmap[fl] &= ~(uint32_t(1) << sl);
+
+        if (_slBitmap[fl] == 0)
+        {
+          _flBitmap &= ~(uint64_t(1) << fl);
+        }
+      }
+    }
+
+    void RemoveFreeBlock(BlockHeader* block)
+    {
+      int fl = 0;
+      int sl = 0;
+      MappingInsert(block->BlockSize, fl, sl);
+
+      RemoveFreeBlock(block, fl, sl);
+    }
+
+    //
+    // Merges physically next block into this one.
+    //
+    void Absorb(BlockHeader* block, BlockHeader* next)
+    {
+      block->BlockSize += next->BlockSize;
+
+      BlockHeader* after = NextPhysical(block);
+      if (after != nullptr)
+      {
+        after->PrevPhysical = block;
+      }
+    }
+
+    //
+    // Splits off the tail of the block if it's big enough
+    // to be a block on its own and returns it to free lists.
+    //
+    void TrimBlock(BlockHeader* block, uint64_t blockSize)
+    {
+      if (block->BlockSize - blockSize < MinBlockSize)
+      {
+        return;
+      }
+
+      BlockHeader* rest = (BlockHeader*)((char*)block + blockSize);
+      rest->Info         = _nullReference;
+      rest->BlockSize    = block->BlockSize - blockSize;
+      rest->IsFree       = true;
+      rest->PrevPhysical = block;
+
+      block->BlockSize = blockSize;
+
+      BlockHeader* next = NextPhysical(rest);
+      if (next != nullptr)
+      {
+        next->PrevPhysical = rest;
+
+        if (next->IsFree)
+        {
+          RemoveFreeBlock(next);
+          Absorb(rest, next);
+        }
+      }
+
+      InsertFreeBlock(rest);
+    }
+
+    Storage<MemorySize> _storage;
+
+    char* _memory = _storage.Data();
+
+    uint64_t _flBitmap = 0;
+    uint32_t _slBitmap[FLCount];
+    BlockHeader* _freeLists[FLCount][SLCount];
+
+    const BlockInfo _nullReference = { 0, nullptr, 0 };
+
+    std::string _tag;
+
+    uint64_t _blockUniqueId = 0;
+};
+
+#endif // include guard
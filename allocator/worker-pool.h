@@ -0,0 +1,159 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Fixed set of threads for parallel loops.
+//
+// Run() hands out loop indices one by one, so items should be
+// big enough to outweigh an atomic increment. Calling thread
+// takes part in the loop, so pool of size N starts N - 1 threads.
+//
+class WorkerPool
+{
+  public:
+    WorkerPool(uint32_t threads = std::thread::hardware_concurrency())
+    {
+      for (uint32_t i = 1; i < threads; i++)
+      {
+        _threads.emplace_back([this]() { WorkerLoop(); });
+      }
+    }
+
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+
+      _wake.notify_all();
+
+      for (auto& t : _threads)
+      {
+        t.join();
+      }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    uint32_t Size() const
+    {
+      return _threads.size() + 1;
+    }
+
+    //
+    // Calls f(i) for every i in [0, count) and returns
+    // when all calls are done. Order of calls is not defined.
+    //
+    template <typename F>
+    void Run(uint64_t count, F&& f)
+    {
+      if (count == 0)
+      {
+        return;
+      }
+
+      if (count == 1 or _threads.empty())
+      {
+        for (uint64_t i = 0; i < count; i++)
+        {
+          f(i);
+        }
+
+        return;
+      }
+
+      std::lock_guard<std::mutex> runLock(_runMutex);
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _job     = [](void* context, uint64_t i) { (*(F*)context)(i); };
+        _context = &f;
+        _count   = count;
+        _busy    = _threads.size();
+
+        _next.store(0, std::memory_order_relaxed);
+
+        _generation++;
+      }
+
+      _wake.notify_all();
+
+      Work();
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done.wait(lock, [this]() { return (_busy == 0); });
+    }
+
+  private:
+    void Work()
+    {
+      uint64_t i = 0;
+
+      while ((i = _next.fetch_add(1, std::memory_order_relaxed)) < _count)
+      {
+        _job(_context, i);
+      }
+    }
+
+    //
+    // Every worker takes part in every generation, late ones
+    // just find nothing left to do, so Run() can wait for all of them.
+    //
+    void WorkerLoop()
+    {
+      uint64_t seen = 0;
+
+      while (true)
+      {
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _wake.wait(lock, [&]() { return (_stop or _generation != seen); });
+
+          if (_stop)
+          {
+            return;
+          }
+
+          seen = _generation;
+        }
+
+        Work();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_busy == 0)
+        {
+          _done.notify_one();
+        }
+      }
+    }
+
+    std::vector<std::thread> _threads;
+
+    std::mutex _runMutex;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+
+    void (*_job)(void*, uint64_t) = nullptr;
+    void* _context  = nullptr;
+    uint64_t _count = 0;
+
+    std::atomic<uint64_t> _next{0};
+
+    uint64_t _generation = 0;
+    uint64_t _busy       = 0;
+    bool _stop           = false;
+};
+
+#endif // include guard
@@ -0,0 +1,20 @@
+#ifndef ZEROING_POLICY_H
+#define ZEROING_POLICY_H
+
+//
+// When allocators clear memory.
+//
+// Eager  - freed blocks, moved-from space and Reset() are zeroed,
+//          so every new block is already clean (default).
+// OnAlloc - nothing is cleared on Free() / Reset() / Defragment(),
+//           only requested bytes are zeroed when block is handed out.
+// None    - memory is never cleared, use AllocZeroed() when needed.
+//
+enum class ZeroingPolicy
+{
+  Eager = 0,
+  OnAlloc,
+  None
+};
+
+#endif // include guard